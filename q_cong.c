@@ -244,7 +244,7 @@ static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *r
 	// result = 3 * diff_throughput - diff_delay - smooth_divide_current_throughput;
 	result = (alpha * qc -> estimated_throughput) / (beta * rs->rtt_us) / (delta * retransmit_division_factor);
 	
-	printk(KERN_INFO "reward : %d", result);
+	// printk(KERN_INFO "reward : %d", result);
 	
 	return result;
 }
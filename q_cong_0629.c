@@ -246,7 +246,7 @@ static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *r
 	// result = (alpha * qc -> estimated_throughput) / (beta * rs->rtt_us) / (delta * retransmit_division_factor);
 	result = qc -> estimated_throughput - qc -> pre_throughput;
 	
-	printk(KERN_INFO "reward : %d", result);
+	// printk(KERN_INFO "reward : %d", result);
 	
 	return result;
 }
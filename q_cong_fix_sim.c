@@ -189,7 +189,7 @@ static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *r
 	
 	result = qc -> estimated_throughput - qc -> pre_throughput;
 	
-	printk(KERN_INFO "reward : %d", result);
+	// printk(KERN_INFO "reward : %d", result);
 	
 	return result;
 }
@@ -0,0 +1 @@
+#include "../../../tcp_shim.h"
@@ -0,0 +1 @@
+/* trace events are not instantiated in the simulator */
@@ -0,0 +1,587 @@
+/*
+ * kshim.h - just enough of the kernel API for tcpql.c to build and run as
+ * an ordinary userspace object. Everything is single threaded: per-CPU
+ * data has one instance, deferred work runs on the simulated clock, and
+ * debugfs files are kept in a table the simulator can read and write.
+ */
+#ifndef _TCPQL_KSHIM_H
+#define _TCPQL_KSHIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <ctype.h>
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef int8_t		s8;
+typedef int16_t		s16;
+typedef int32_t		s32;
+typedef int64_t		s64;
+
+#define U16_MAX			UINT16_MAX
+#define U32_MAX			UINT32_MAX
+#define S16_MIN			INT16_MIN
+#define S16_MAX			INT16_MAX
+
+#define __init
+#define __exit
+#define __percpu
+#define __user
+#define __always_unused		__attribute__((unused))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)		((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_t(t, v, lo, hi)	min_t(t, max_t(t, v, lo), hi)
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+/* type generic, as the kernel's; shadows the int-only libc abs() */
+#define abs(x)			({ __typeof__(x) __x = (x); __x < 0 ? -__x : __x; })
+#define DIV_ROUND_CLOSEST(x, d)	(((x) + (d) / 2) / (d))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define BUILD_BUG_ON(c)		_Static_assert(!(c), #c)
+#define IS_ENABLED(option)	0
+#define container_of(ptr, type, member)	((type *)((char *)(ptr) - offsetof(type, member)))
+#ifdef SIM_THREADS
+/* marked accesses may race, as KCSAN allows them to */
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#else
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+#endif
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+#define ____cacheline_aligned		__attribute__((aligned(64)))
+
+/* module plumbing */
+#define THIS_MODULE		NULL
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_PARM_DESC(n, d)
+
+/* module parameters register themselves so the simulator can set them */
+enum sim_param_type {
+	sim_param_bool, sim_param_int, sim_param_uint, sim_param_ulong, sim_param_charp,
+};
+/* nump is NULL for a scalar, else it receives the element count of an array */
+void sim_register_param(const char *name, void *var, enum sim_param_type type, int max, int *nump);
+#define module_param_named(name, var, type, perm)				\
+	static void __attribute__((constructor)) sim_param_init_##name(void)	\
+	{									\
+		sim_register_param(#name, &(var), sim_param_##type, 1, NULL);	\
+	}
+/* not forwarded to module_param_named, which would expand bool to _Bool */
+#define module_param(name, type, perm)						\
+	static void __attribute__((constructor)) sim_param_init_##name(void)	\
+	{									\
+		sim_register_param(#name, &(name), sim_param_##type, 1, NULL);	\
+	}
+#define module_param_array(name, type, nump, perm)				\
+	static void __attribute__((constructor)) sim_param_init_##name(void)	\
+	{									\
+		sim_register_param(#name, (name), sim_param_##type,		\
+				   ARRAY_SIZE(name), (nump));			\
+	}
+#define module_init(fn)		int sim_module_init(void) { return fn(); }
+#define module_exit(fn)		void sim_module_exit(void) { fn(); }
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+struct module;
+
+#define KERN_INFO		""
+#define KERN_DEBUG		""
+#define KERN_ERR		""
+#define printk(...)		do { } while (0)
+#define pr_info(...)		do { } while (0)
+#define pr_warn(...)		do { } while (0)
+#define pr_debug(...)		do { } while (0)
+
+/* time: the simulator owns the clock */
+#define HZ			1000
+extern u64 sim_now_ns;
+#define jiffies			((unsigned long)(READ_ONCE(sim_now_ns) / 1000000))
+#define tcp_jiffies32		((u32)jiffies)
+#define msecs_to_jiffies(ms)	((unsigned long)(ms))
+#define jiffies_to_msecs(j)	((unsigned int)(j))
+#define after(a, b)		((s32)((b) - (a)) < 0)
+#define before(a, b)		after(b, a)
+static inline u64 ktime_get_ns(void) { return READ_ONCE(sim_now_ns); }
+#define NSEC_PER_USEC		1000ULL
+#define USEC_PER_MSEC		1000ULL
+#define USEC_PER_SEC		1000000ULL
+#define NSEC_PER_SEC		1000000000ULL
+
+/* math64 */
+static inline s64 div_s64_rem(s64 dividend, s32 divisor, s32 *remainder)
+{
+	*remainder = dividend % divisor;
+	return dividend / divisor;
+}
+static inline s64 div_s64(s64 dividend, s32 divisor) { return dividend / divisor; }
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+static inline u64 div64_u64(u64 dividend, u64 divisor) { return dividend / divisor; }
+static inline s64 div64_s64(s64 dividend, s64 divisor) { return dividend / divisor; }
+
+/* atomics: real ones, tcpql-stress-mt shares them between threads */
+typedef struct { int counter; } atomic_t;
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, i, __ATOMIC_RELAXED)
+#define ATOMIC_INIT(i)		{ (i) }
+static inline void atomic_add(int i, atomic_t *v) { __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED); }
+static inline int atomic_inc_return(atomic_t *v) { return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST); }
+#define cmpxchg(ptr, o, n)	__sync_val_compare_and_swap(ptr, o, n)
+static inline int atomic_xchg(atomic_t *v, int n) { return __atomic_exchange_n(&v->counter, n, __ATOMIC_SEQ_CST); }
+
+/* per-CPU: a single CPU */
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name
+#define per_cpu(var, cpu)		(*((void)(cpu), &(var)))
+#define this_cpu_read(var)		(var)
+#define this_cpu_ptr(ptr)		(ptr)
+#define per_cpu_ptr(ptr, cpu)		((void)(cpu), (ptr))
+#define alloc_percpu(type)		((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr)		free(ptr)
+#define local_bh_disable()		do { } while (0)
+#define local_bh_enable()		do { } while (0)
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define smp_processor_id()		0
+
+static inline u32 hash_ptr(const void *ptr, unsigned int bits)
+{
+	u64 v = (u64)(uintptr_t)ptr * 0x61C8864680B583EBull;
+
+	return (u32)(v >> (64 - bits));
+}
+
+#define ilog2(n)		(63 - __builtin_clzll(n))
+static inline unsigned long int_sqrt(unsigned long x)
+{
+	unsigned long r = 0, b = 1UL << (sizeof(long) * 8 - 2);
+
+	while (b > x)
+		b >>= 2;
+	for (; b; b >>= 2) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+static inline u32 hash_64(u64 val, unsigned int bits)
+{
+	return (u32)((val * 0x61C8864680B583EBull) >> (64 - bits));
+}
+
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32)(((u64)val * ep_ro) >> 32);
+}
+
+void get_random_bytes(void *buf, size_t len);
+static inline u32 get_random_u32(void)
+{
+	u32 v;
+
+	get_random_bytes(&v, sizeof(v));
+	return v;
+}
+
+/* memory */
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		0
+static inline void *vzalloc(size_t n) { return calloc(1, n); }
+static inline void *vmalloc(size_t n) { return malloc(n); }
+static inline void vfree(const void *p) { free((void *)p); }
+static inline void *kvzalloc(size_t n, int gfp) { (void)gfp; return calloc(1, n); }
+static inline void kvfree(const void *p) { free((void *)p); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *kmemdup(const void *src, size_t n, int gfp)
+{
+	void *p = malloc(n);
+
+	(void)gfp;
+	return p ? memcpy(p, src, n) : NULL;
+}
+
+/* sysctl tables: the simulator writes them through sim_sysctl_set() */
+struct ctl_table {
+	const char	*procname;
+	void		*data;
+	int		maxlen;
+	unsigned short	mode;
+	int		(*proc_handler)(const struct ctl_table *table, const char *value);
+	void		*extra1;
+	void		*extra2;
+};
+struct ctl_table_header {
+	const struct ctl_table	*ctl_table_arg;
+	size_t			size;
+};
+int proc_douintvec_minmax(const struct ctl_table *table, const char *value);
+
+/* windowed min/max filter of lib/win_minmax.c */
+struct minmax_sample { u32 t; u32 v; };
+struct minmax { struct minmax_sample s[3]; };
+
+static inline u32 minmax_get(const struct minmax *m) { return m->s[0].v; }
+
+static inline u32 minmax_reset(struct minmax *m, u32 t, u32 meas)
+{
+	struct minmax_sample val = { .t = t, .v = meas };
+
+	m->s[2] = m->s[1] = m->s[0] = val;
+	return m->s[0].v;
+}
+
+static inline u32 minmax_subwin_update(struct minmax *m, u32 win, const struct minmax_sample *val)
+{
+	u32 dt = val->t - m->s[0].t;
+
+	if (dt > win) {
+		m->s[0] = m->s[1];
+		m->s[1] = m->s[2];
+		m->s[2] = *val;
+		if (val->t - m->s[0].t > win) {
+			m->s[0] = m->s[1];
+			m->s[1] = m->s[2];
+			m->s[2] = *val;
+		}
+	} else if (m->s[1].t == m->s[0].t && dt > win / 4) {
+		m->s[2] = m->s[1] = *val;
+	} else if (m->s[2].t == m->s[1].t && dt > win / 2) {
+		m->s[2] = *val;
+	}
+	return m->s[0].v;
+}
+
+static inline u32 minmax_running_max(struct minmax *m, u32 win, u32 t, u32 meas)
+{
+	struct minmax_sample val = { .t = t, .v = meas };
+
+	if (val.v >= m->s[0].v || val.t - m->s[2].t > win)
+		return minmax_reset(m, t, meas);
+	if (val.v >= m->s[1].v)
+		m->s[2] = m->s[1] = val;
+	else if (val.v >= m->s[2].v)
+		m->s[2] = val;
+	return minmax_subwin_update(m, win, &val);
+}
+
+/* slab caches are plain heap allocations of a fixed size */
+#define SLAB_HWCACHE_ALIGN	0
+struct kmem_cache { size_t size; };
+static inline struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+						   unsigned int align, unsigned long flags, void *ctor)
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	(void)name; (void)align; (void)flags; (void)ctor;
+	if (c)
+		c->size = size;
+	return c;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *c) { free(c); }
+/* objects are cache line aligned, as with SLAB_HWCACHE_ALIGN */
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, int gfp)
+{
+	size_t size = (c->size + 63) & ~(size_t)63;
+	void *p = aligned_alloc(64, size);
+
+	(void)gfp;
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) { (void)c; free(p); }
+
+/* lists and hash tables, the subset of list.h and hashtable.h in use */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD(name)		struct list_head name = { &(name), &(name) }
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l->prev = l; }
+static inline bool list_empty(const struct list_head *l) { return l->next == l; }
+static inline void list_add_tail(struct list_head *n, struct list_head *h)
+{
+	n->prev = h->prev;
+	n->next = h;
+	h->prev->next = n;
+	h->prev = n;
+}
+static inline void list_del_init(struct list_head *n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	INIT_LIST_HEAD(n);
+}
+#define list_first_entry(h, type, member)	container_of((h)->next, type, member)
+
+struct hlist_node { struct hlist_node *next, **pprev; };
+struct hlist_head { struct hlist_node *first; };
+#define DEFINE_HASHTABLE(name, bits)	struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name)			ARRAY_SIZE(name)
+#define HASH_BITS(name)			__builtin_ctz(HASH_SIZE(name))
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	n->next = h->first;
+	if (h->first)
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+static inline void hash_del(struct hlist_node *n)
+{
+	if (!n->pprev)
+		return;
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+#define hash_add(table, node, key)	hlist_add_head(node, &(table)[hash_64(key, HASH_BITS(table))])
+#define hlist_entry_safe(ptr, type, member)					\
+	({ __typeof__(ptr) ____ptr = (ptr); ____ptr ? container_of(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member)					\
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos;	\
+	     pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+#define hash_for_each_possible(table, obj, member, key)				\
+	hlist_for_each_entry(obj, &(table)[hash_64(key, HASH_BITS(table))], member)
+#define hash_for_each_safe(table, bkt, tmp, obj, member)				\
+	for ((bkt) = 0; (bkt) < (int)HASH_SIZE(table); (bkt)++)			\
+		for (obj = hlist_entry_safe((table)[bkt].first, __typeof__(*(obj)), member);	\
+		     obj && ((tmp) = (obj)->member.next, 1);				\
+		     obj = hlist_entry_safe(tmp, __typeof__(*(obj)), member))
+
+/* deferred work: run by the simulator once its clock passes the due time */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+struct work_struct { work_func_t func; };
+struct delayed_work { struct work_struct work; };
+#define DECLARE_DELAYED_WORK(n, f)	struct delayed_work n = { .work = { .func = (f) } }
+bool sim_queue_delayed_work(struct delayed_work *dw, unsigned long delay);
+bool sim_cancel_delayed_work(struct delayed_work *dw);
+#define schedule_delayed_work(dw, delay)	sim_queue_delayed_work(dw, delay)
+#define cancel_delayed_work_sync(dw)		sim_cancel_delayed_work(dw)
+#define system_wq				NULL
+#define mod_delayed_work(wq, dw, delay)		\
+	(sim_cancel_delayed_work(dw), sim_queue_delayed_work(dw, delay))
+
+/* file plumbing for the debugfs files, reachable through sim_debugfs_*() */
+typedef u16		__le16;
+typedef u32		__le32;
+typedef u32		__be32;
+#define be32_to_cpu(x)		__builtin_bswap32(x)
+#define cpu_to_be32(x)		__builtin_bswap32(x)
+#define cpu_to_le16(x)		((u16)(x))
+#define cpu_to_le32(x)		((u32)(x))
+#define le16_to_cpu(x)		((u16)(x))
+#define le32_to_cpu(x)		((u32)(x))
+
+#define FMODE_READ		0x1
+#define FMODE_WRITE		0x2
+
+struct dentry;
+struct inode { void *i_private; };
+struct file { void *private_data; unsigned int f_mode; };
+struct seq_file { FILE *out; };
+
+struct file_operations {
+	struct module	*owner;
+	int		(*open)(struct inode *, struct file *);
+	ssize_t		(*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t		(*write)(struct file *, const char __user *, size_t, loff_t *);
+	int		(*release)(struct inode *, struct file *);
+	loff_t		(*llseek)(struct file *, loff_t, int);
+	int		(*sim_show)(struct seq_file *, void *);	/* seq_file show routine */
+};
+
+#define default_llseek		NULL
+#define DEFINE_SHOW_ATTRIBUTE(name)					\
+	static const struct file_operations name##_fops = { .sim_show = name##_show }
+
+static inline void seq_printf(struct seq_file *seq, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(seq->out, fmt, ap);
+	va_end(ap);
+}
+#define seq_puts(seq, s)	fputs(s, (seq)->out)
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline ssize_t simple_read_from_buffer(void __user *to, size_t count, loff_t *ppos,
+					      const void *from, size_t available)
+{
+	loff_t pos = *ppos;
+
+	if (pos < 0)
+		return -EINVAL;
+	if ((size_t)pos >= available || !count)
+		return 0;
+	if (count > available - pos)
+		count = available - pos;
+	memcpy(to, (const char *)from + pos, count);
+	*ppos = pos + count;
+	return count;
+}
+
+static inline ssize_t simple_write_to_buffer(void *to, size_t available, loff_t *ppos,
+					     const void __user *from, size_t count)
+{
+	loff_t pos = *ppos;
+
+	if (pos < 0)
+		return -EINVAL;
+	if ((size_t)pos >= available || !count)
+		return 0;
+	if (count > available - pos)
+		count = available - pos;
+	memcpy((char *)to + pos, from, count);
+	*ppos = pos + count;
+	return count;
+}
+
+struct dentry *sim_debugfs_create(const char *name, void *data, const struct file_operations *fops);
+void sim_debugfs_remove_all(void);
+static inline struct dentry *debugfs_create_dir(const char *n, struct dentry *p) { (void)n; (void)p; return NULL; }
+static inline struct dentry *debugfs_create_file(const char *n, unsigned short mode, struct dentry *p,
+						 void *data, const struct file_operations *fops)
+{
+	(void)mode; (void)p;
+	return sim_debugfs_create(n, data, fops);
+}
+static inline void debugfs_remove_recursive(struct dentry *d) { (void)d; sim_debugfs_remove_all(); }
+
+/*
+ * locking and RCU: no-ops for one thread. SIM_THREADS, the build of
+ * tcpql-stress-mt, makes them pthread locks, and RCU a reader/writer lock
+ * whose write side waits out every reader, as a grace period does.
+ */
+#ifdef SIM_THREADS
+#include <pthread.h>
+
+struct mutex { pthread_mutex_t m; };
+#define DEFINE_MUTEX(name)	struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_lock(l)		pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)		pthread_mutex_unlock(&(l)->m)
+
+struct spinlock { pthread_mutex_t m; };
+typedef struct spinlock spinlock_t;
+#define DEFINE_SPINLOCK(name)	spinlock_t name = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock_init(l)	pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l)		pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l)		pthread_mutex_unlock(&(l)->m)
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+#else
+struct mutex { int unused; };
+#define DEFINE_MUTEX(name)	struct mutex name
+#define mutex_lock(m)		do { (void)(m); } while (0)
+#define mutex_unlock(m)		do { (void)(m); } while (0)
+
+struct spinlock { int unused; };
+typedef struct spinlock spinlock_t;
+#define DEFINE_SPINLOCK(name)	spinlock_t name
+#define spin_lock_init(l)	do { (void)(l); } while (0)
+#define spin_lock(l)		do { (void)(l); } while (0)
+#define spin_unlock(l)		do { (void)(l); } while (0)
+
+#define rcu_read_lock()			do { } while (0)
+#define rcu_read_unlock()		do { } while (0)
+#define synchronize_rcu()		do { } while (0)
+#endif
+#define lockdep_is_held(m)	((void)(m), 1)
+#define spin_lock_bh(l)		spin_lock(l)
+#define spin_unlock_bh(l)	spin_unlock(l)
+
+#define __rcu
+#define rcu_dereference(p)		READ_ONCE(p)
+#define rcu_dereference_check(p, c)	((void)(c), READ_ONCE(p))
+#define rcu_dereference_protected(p, c)	((void)(c), (p))
+#define rcu_assign_pointer(p, v)	smp_store_release(&(p), v)
+#define RCU_INIT_POINTER(p, v)		((p) = (v))
+
+/* refcounts: misuse the kernel would warn about aborts */
+typedef struct { int refs; } refcount_t;
+#define refcount_set(r, n)	__atomic_store_n(&(r)->refs, n, __ATOMIC_RELAXED)
+#define refcount_read(r)	__atomic_load_n(&(r)->refs, __ATOMIC_RELAXED)
+static inline void refcount_bad(const char *op, int refs)
+{
+	fprintf(stderr, "refcount_t: %s on %d\n", op, refs);
+	abort();
+}
+static inline void refcount_inc(refcount_t *r)
+{
+	int old = __atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+
+	if (old <= 0)
+		refcount_bad("increment", old);
+}
+static inline bool refcount_inc_not_zero(refcount_t *r)
+{
+	int old = refcount_read(r);
+
+	do {
+		if (!old)
+			return false;
+		if (old < 0)
+			refcount_bad("increment", old);
+	} while (!__atomic_compare_exchange_n(&r->refs, &old, old + 1, false,
+					      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+/* true with the lock held when the last reference went */
+static inline bool refcount_dec_and_lock(refcount_t *r, spinlock_t *lock)
+{
+	int old = refcount_read(r);
+
+	do {
+		if (old <= 0)
+			refcount_bad("decrement", old);
+		if (old == 1)
+			break;
+	} while (!__atomic_compare_exchange_n(&r->refs, &old, old - 1, false,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (old > 1)
+		return false;
+
+	spin_lock(lock);
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		return true;
+	spin_unlock(lock);
+	return false;
+}
+
+/* tracepoints compile to empty inlines */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	static inline void trace_##name(proto) { }			\
+	static inline bool trace_##name##_enabled(void) { return false; }
+
+#endif
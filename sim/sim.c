@@ -0,0 +1,632 @@
+/*
+ * sim.c - userspace runtime behind kshim.h and the fluid bottleneck model.
+ */
+#include <math.h>
+
+#include "sim.h"
+
+u64 sim_now_ns;
+struct tcp_congestion_ops *sim_registered_ca;
+
+int sim_module_init(void);
+void sim_module_exit(void);
+
+/* ---- module parameters ---- */
+
+#define SIM_MAX_PARAMS	64
+
+static struct {
+	const char		*name;
+	void			*var;
+	enum sim_param_type	type;
+	int			max;
+	int			*nump;
+	u64			strdup_mask;	/* charp elements set by us, not defaults */
+} sim_params[SIM_MAX_PARAMS];
+static int sim_nparams;
+
+void sim_register_param(const char *name, void *var, enum sim_param_type type, int max, int *nump)
+{
+	if (sim_nparams == SIM_MAX_PARAMS) {
+		fprintf(stderr, "sim: too many module parameters\n");
+		abort();
+	}
+	if (max > 64) {
+		fprintf(stderr, "sim: module parameter %s has more than 64 elements\n", name);
+		abort();
+	}
+	sim_params[sim_nparams].name = name;
+	sim_params[sim_nparams].var = var;
+	sim_params[sim_nparams].type = type;
+	sim_params[sim_nparams].max = max;
+	sim_params[sim_nparams].nump = nump;
+	sim_nparams++;
+}
+
+/* parse one element of value[0..len) into element idx of the parameter */
+static int sim_parse_param(int p, int idx, const char *value, size_t len)
+{
+	char buf[64], *end = buf;
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	switch (sim_params[p].type) {
+	case sim_param_bool:
+		((bool *)sim_params[p].var)[idx] = !strcmp(buf, "1") || !strcmp(buf, "y") ||
+						   !strcmp(buf, "Y");
+		break;
+	case sim_param_int:
+		((int *)sim_params[p].var)[idx] = strtol(buf, &end, 0);
+		break;
+	case sim_param_uint:
+		((unsigned int *)sim_params[p].var)[idx] = strtoul(buf, &end, 0);
+		break;
+	case sim_param_ulong:
+		((unsigned long *)sim_params[p].var)[idx] = strtoul(buf, &end, 0);
+		break;
+	case sim_param_charp:
+		/*
+		 * like the kernel, the strings live as long as the module; a
+		 * string replaced by a later setting is ours to free
+		 */
+		if (sim_params[p].strdup_mask & (1ull << idx))
+			free(((char **)sim_params[p].var)[idx]);
+		((char **)sim_params[p].var)[idx] = strdup(buf);
+		sim_params[p].strdup_mask |= 1ull << idx;
+		break;
+	}
+	return *end && sim_params[p].type != sim_param_bool &&
+	       sim_params[p].type != sim_param_charp ? -EINVAL : 0;
+}
+
+int sim_set_param(const char *name, const char *value)
+{
+	const char *comma;
+	int i, n, ret;
+
+	for (i = 0; i < sim_nparams; i++) {
+		if (strcmp(sim_params[i].name, name))
+			continue;
+		if (!sim_params[i].nump)
+			return sim_parse_param(i, 0, value, strlen(value));
+		for (n = 0; ; n++) {
+			if (n == sim_params[i].max)
+				return -EINVAL;
+			comma = strchr(value, ',');
+			ret = sim_parse_param(i, n, value, comma ? (size_t)(comma - value) : strlen(value));
+			if (ret)
+				return ret;
+			if (!comma)
+				break;
+			value = comma + 1;
+		}
+		*sim_params[i].nump = n + 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/* ---- randomness: deterministic for a given seed ---- */
+
+static u64 sim_rng = 0x9e3779b97f4a7c15ull;
+
+void sim_seed(u64 seed)
+{
+	sim_rng = seed ? seed : 0x9e3779b97f4a7c15ull;
+}
+
+static u64 sim_rand(void)
+{
+	sim_rng ^= sim_rng << 13;
+	sim_rng ^= sim_rng >> 7;
+	sim_rng ^= sim_rng << 17;
+	return sim_rng;
+}
+
+void get_random_bytes(void *buf, size_t len)
+{
+	u8 *p = buf;
+	u64 r;
+
+	while (len) {
+		r = sim_rand();
+		for (; len && r; len--, r >>= 8)
+			*p++ = (u8)r;
+	}
+}
+
+/* ---- threads: RCU for SIM_THREADS ---- */
+
+#ifdef SIM_THREADS
+static pthread_rwlock_t sim_rcu = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int sim_rcu_nesting;
+
+void rcu_read_lock(void)
+{
+	if (!sim_rcu_nesting++)
+		pthread_rwlock_rdlock(&sim_rcu);
+}
+
+void rcu_read_unlock(void)
+{
+	if (!--sim_rcu_nesting)
+		pthread_rwlock_unlock(&sim_rcu);
+}
+
+/* every reader that was inside a read section has left it */
+void synchronize_rcu(void)
+{
+	pthread_rwlock_wrlock(&sim_rcu);
+	pthread_rwlock_unlock(&sim_rcu);
+}
+#endif
+
+/* ---- deferred work on the simulated clock ---- */
+
+#define SIM_MAX_WORK	8
+
+static struct {
+	struct delayed_work	*dw;
+	u64			due_ns;
+} sim_work[SIM_MAX_WORK];
+static DEFINE_SPINLOCK(sim_work_lock);
+bool sim_work_thread;
+
+bool sim_queue_delayed_work(struct delayed_work *dw, unsigned long delay)
+{
+	int i, slot = -1;
+
+	spin_lock(&sim_work_lock);
+	for (i = 0; i < SIM_MAX_WORK; i++) {
+		if (sim_work[i].dw == dw) {
+			spin_unlock(&sim_work_lock);
+			return false;
+		}
+		if (!sim_work[i].dw && slot < 0)
+			slot = i;
+	}
+	if (slot < 0) {
+		fprintf(stderr, "sim: too much pending work\n");
+		abort();
+	}
+	sim_work[slot].dw = dw;
+	sim_work[slot].due_ns = READ_ONCE(sim_now_ns) + (u64)jiffies_to_msecs(delay) * 1000000;
+	spin_unlock(&sim_work_lock);
+	return true;
+}
+
+bool sim_cancel_delayed_work(struct delayed_work *dw)
+{
+	bool found = false;
+	int i;
+
+	spin_lock(&sim_work_lock);
+	for (i = 0; i < SIM_MAX_WORK; i++) {
+		if (sim_work[i].dw == dw) {
+			sim_work[i].dw = NULL;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&sim_work_lock);
+	return found;
+}
+
+void sim_run_work(void)
+{
+	struct delayed_work *dw;
+	int i;
+
+	for (i = 0; i < SIM_MAX_WORK; i++) {
+		spin_lock(&sim_work_lock);
+		dw = sim_work[i].dw;
+		if (!dw || sim_work[i].due_ns > READ_ONCE(sim_now_ns)) {
+			spin_unlock(&sim_work_lock);
+			continue;
+		}
+		/* the handler may queue itself again */
+		sim_work[i].dw = NULL;
+		spin_unlock(&sim_work_lock);
+		dw->work.func(&dw->work);
+	}
+}
+
+/* ---- debugfs ---- */
+
+#define SIM_MAX_FILES	16
+
+static struct {
+	const char			*name;
+	void				*data;
+	const struct file_operations	*fops;
+} sim_files[SIM_MAX_FILES];
+
+struct dentry *sim_debugfs_create(const char *name, void *data, const struct file_operations *fops)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_FILES; i++) {
+		if (sim_files[i].name)
+			continue;
+		sim_files[i].name = name;
+		sim_files[i].data = data;
+		sim_files[i].fops = fops;
+		break;
+	}
+	return NULL;
+}
+
+void sim_debugfs_remove_all(void)
+{
+	memset(sim_files, 0, sizeof(sim_files));
+}
+
+static int sim_debugfs_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_FILES; i++)
+		if (sim_files[i].name && !strcmp(sim_files[i].name, name))
+			return i;
+	return -1;
+}
+
+int sim_debugfs_show(const char *name, FILE *out)
+{
+	struct seq_file seq = { .out = out };
+	int i = sim_debugfs_find(name);
+
+	if (i < 0 || !sim_files[i].fops->sim_show)
+		return -ENOENT;
+	return sim_files[i].fops->sim_show(&seq, NULL);
+}
+
+static int sim_debugfs_open(int i, struct inode *inode, struct file *file, unsigned int mode)
+{
+	inode->i_private = sim_files[i].data;
+	file->private_data = NULL;
+	file->f_mode = mode;
+	return sim_files[i].fops->open ? sim_files[i].fops->open(inode, file) : 0;
+}
+
+/* read a whole binary debugfs file into out */
+int sim_debugfs_save(const char *name, FILE *out)
+{
+	struct inode inode;
+	struct file file;
+	char buf[4096];
+	loff_t pos = 0;
+	ssize_t n;
+	int i = sim_debugfs_find(name);
+	int ret;
+
+	if (i < 0 || !sim_files[i].fops->read)
+		return -ENOENT;
+	ret = sim_debugfs_open(i, &inode, &file, FMODE_READ);
+	if (ret)
+		return ret;
+	while ((n = sim_files[i].fops->read(&file, buf, sizeof(buf), &pos)) > 0)
+		fwrite(buf, 1, n, out);
+	if (sim_files[i].fops->release)
+		sim_files[i].fops->release(&inode, &file);
+	return n < 0 ? (int)n : 0;
+}
+
+/* write the contents of in to a binary debugfs file */
+int sim_debugfs_load(const char *name, FILE *in)
+{
+	struct inode inode;
+	struct file file;
+	char buf[4096];
+	loff_t pos = 0;
+	ssize_t n = 0;
+	size_t len;
+	int i = sim_debugfs_find(name);
+	int ret;
+
+	if (i < 0 || !sim_files[i].fops->write)
+		return -ENOENT;
+	ret = sim_debugfs_open(i, &inode, &file, FMODE_WRITE);
+	if (ret)
+		return ret;
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		n = sim_files[i].fops->write(&file, buf, len, &pos);
+		if (n < 0)
+			break;
+	}
+	if (sim_files[i].fops->release)
+		sim_files[i].fops->release(&inode, &file);
+	return n < 0 ? (int)n : 0;
+}
+
+/* ---- network namespace and sysctls ---- */
+
+struct net init_net;
+
+#define SIM_MAX_PERNET	4
+#define SIM_MAX_SYSCTL	4
+
+static void *sim_net_generic[SIM_MAX_PERNET];
+static struct ctl_table_header sim_sysctl[SIM_MAX_SYSCTL];
+
+int register_pernet_subsys(struct pernet_operations *ops)
+{
+	unsigned int id;
+	int ret;
+
+	for (id = 0; id < SIM_MAX_PERNET && sim_net_generic[id]; id++)
+		;
+	if (id == SIM_MAX_PERNET) {
+		fprintf(stderr, "sim: too many pernet subsystems\n");
+		abort();
+	}
+	sim_net_generic[id] = calloc(1, ops->size ? ops->size : 1);
+	if (!sim_net_generic[id])
+		return -ENOMEM;
+	*ops->id = id;
+	ret = ops->init ? ops->init(&init_net) : 0;
+	if (ret) {
+		free(sim_net_generic[id]);
+		sim_net_generic[id] = NULL;
+	}
+	return ret;
+}
+
+void unregister_pernet_subsys(struct pernet_operations *ops)
+{
+	if (ops->exit)
+		ops->exit(&init_net);
+	free(sim_net_generic[*ops->id]);
+	sim_net_generic[*ops->id] = NULL;
+}
+
+void *net_generic(const struct net *net, unsigned int id)
+{
+	(void)net;
+	return sim_net_generic[id];
+}
+
+struct ctl_table_header *register_net_sysctl_sz(struct net *net, const char *path,
+						struct ctl_table *table, size_t size)
+{
+	int i;
+
+	(void)net;
+	(void)path;
+	for (i = 0; i < SIM_MAX_SYSCTL; i++) {
+		if (sim_sysctl[i].ctl_table_arg)
+			continue;
+		sim_sysctl[i].ctl_table_arg = table;
+		sim_sysctl[i].size = size;
+		return &sim_sysctl[i];
+	}
+	return NULL;
+}
+
+void unregister_net_sysctl_table(struct ctl_table_header *header)
+{
+	header->ctl_table_arg = NULL;
+}
+
+int proc_douintvec_minmax(const struct ctl_table *table, const char *value)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(value, &end, 0);
+	if (errno || *end || !*value || v > UINT_MAX)
+		return -EINVAL;
+	if ((table->extra1 && v < *(unsigned int *)table->extra1) ||
+	    (table->extra2 && v > *(unsigned int *)table->extra2))
+		return -EINVAL;
+	*(unsigned int *)table->data = v;
+	return 0;
+}
+
+int sim_sysctl_set(const char *name, const char *value)
+{
+	const struct ctl_table *t;
+	size_t j;
+	int i;
+
+	for (i = 0; i < SIM_MAX_SYSCTL; i++) {
+		for (j = 0; sim_sysctl[i].ctl_table_arg && j < sim_sysctl[i].size; j++) {
+			t = &sim_sysctl[i].ctl_table_arg[j];
+			if (!strcmp(t->procname, name))
+				return t->proc_handler(t, value);
+		}
+	}
+	return -ENOENT;
+}
+
+/* ---- module lifetime ---- */
+
+int sim_load(void)
+{
+	int ret = sim_module_init();
+
+	if (!ret && !sim_registered_ca)
+		ret = -ENODEV;
+	return ret;
+}
+
+void sim_unload(void)
+{
+	sim_module_exit();
+}
+
+/* ---- bottleneck ---- */
+
+int sim_init(struct sim *s, const struct sim_link_cfg *cfg, int nflows)
+{
+	memset(s, 0, sizeof(*s));
+	s->cfg = *cfg;
+	s->nflows = nflows;
+	s->flows = calloc(nflows, sizeof(*s->flows));
+	return s->flows ? 0 : -ENOMEM;
+}
+
+void sim_free(struct sim *s)
+{
+	int i;
+
+	for (i = 0; i < s->nflows; i++)
+		if (s->flows[i].open)
+			sim_flow_close(s, &s->flows[i]);
+	free(s->flows);
+	s->flows = NULL;
+}
+
+double sim_current_rtt_us(const struct sim *s)
+{
+	return s->cfg.rtt_us + s->queue * 8 / s->cfg.bw_bps * 1e6;
+}
+
+void sim_flow_open(struct sim *s, struct sim_flow *f)
+{
+	struct tcp_sock *tp = &f->tp;
+
+	memset(f, 0, sizeof(*f));
+	/* flow i talks to 10.0.0.i+1, so they share a /24 but not a /32 */
+	f->tp.inet_conn.icsk_sk.sk_family = AF_INET;
+	f->tp.inet_conn.icsk_sk.sk_daddr = cpu_to_be32(0x0a000001 + (u32)(f - s->flows));
+	f->tp.inet_conn.icsk_sk.sk_max_pacing_rate = ~0UL;
+	tp->snd_cwnd = TCP_INIT_CWND;
+	tp->snd_cwnd_clamp = ~0U;
+	tp->mss_cache = s->cfg.mss;
+	/* the handshake gave one RTT sample */
+	tp->min_rtt_us = (u32)sim_current_rtt_us(s);
+	tp->srtt_us = tp->min_rtt_us << 3;
+	tp->tcp_mstamp = sim_now_ns / NSEC_PER_USEC;
+	f->last_ack_us = tp->tcp_mstamp;
+	f->open = true;
+	sim_registered_ca->init(sim_sk(f));
+}
+
+void sim_flow_close(struct sim *s, struct sim_flow *f)
+{
+	(void)s;
+	if (sim_registered_ca->release)
+		sim_registered_ca->release(sim_sk(f));
+	f->open = false;
+}
+
+static void sim_flow_ack(struct sim *s, struct sim_flow *f, u32 acked, u32 lost, double rtt_us)
+{
+	struct tcp_sock *tp = &f->tp;
+	struct rate_sample rs;
+	u64 now_us = sim_now_ns / NSEC_PER_USEC;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.prior_mstamp = f->last_ack_us;
+	rs.prior_delivered = tp->delivered;
+	rs.prior_in_flight = tp->packets_out;
+	rs.delivered = acked;
+	rs.acked_sacked = acked;
+	rs.losses = lost;
+	rs.interval_us = now_us - f->last_ack_us;
+	rs.rtt_us = acked ? (long)rtt_us : -1;
+
+	tp->delivered += acked;
+	tp->total_retrans += lost;
+	tp->tcp_mstamp = now_us;
+	if (acked) {
+		tp->srtt_us = tp->srtt_us - (tp->srtt_us >> 3) + (u32)rtt_us;
+		if ((u32)rtt_us < tp->min_rtt_us)
+			tp->min_rtt_us = (u32)rtt_us;
+	}
+
+	if (lost) {
+		tp->inet_conn.icsk_ca_state = TCP_CA_Recovery;
+		f->recovery_until_us = now_us + (u64)rtt_us;
+	} else if (now_us >= f->recovery_until_us) {
+		tp->inet_conn.icsk_ca_state = TCP_CA_Open;
+	}
+
+	f->last_ack_us = now_us;
+	sim_registered_ca->cong_control(sim_sk(f), &rs);
+}
+
+void sim_step(struct sim *s)
+{
+	const struct sim_link_cfg *c = &s->cfg;
+	double dt = c->dt_us / 1e6;
+	double bw = c->bw_bps / 8;
+	double rtt_us = sim_current_rtt_us(s);
+	double in = 0, out, drop, share, deliv, lost;
+	struct sim_flow *f;
+	u32 cwnd, acked, nlost, nsent;
+	int i;
+
+	for (i = 0; i < s->nflows; i++) {
+		f = &s->flows[i];
+		f->rate = 0;
+		if (!f->open)
+			continue;
+		/* an empty window would be recovered by the RTO */
+		cwnd = f->tp.snd_cwnd ? f->tp.snd_cwnd : 1;
+		f->rate = (double)cwnd * c->mss / (rtt_us / 1e6);
+		if (f->tp.inet_conn.icsk_sk.sk_pacing_rate &&
+		    f->tp.inet_conn.icsk_sk.sk_pacing_rate < f->rate)
+			f->rate = f->tp.inet_conn.icsk_sk.sk_pacing_rate;
+		in += f->rate * dt;
+	}
+
+	out = min(s->queue + in, bw * dt);
+	s->queue += in - out;
+	drop = s->queue > c->buf_bytes ? s->queue - c->buf_bytes : 0;
+	s->queue -= drop;
+
+	WRITE_ONCE(sim_now_ns, sim_now_ns + (u64)c->dt_us * NSEC_PER_USEC);
+	s->steps++;
+	s->rtt_sum_us += rtt_us;
+	s->rtt_samples++;
+
+	for (i = 0; in > 0 && i < s->nflows; i++) {
+		f = &s->flows[i];
+		if (!f->open || f->rate == 0)
+			continue;
+		share = f->rate * dt / in;
+		deliv = out * share;
+		lost = drop * share + deliv * c->loss;
+		deliv -= deliv * c->loss;
+
+		f->sent += f->rate * dt / c->mss;
+		f->acked += deliv / c->mss;
+		f->lost += lost / c->mss;
+		nsent = (u32)f->sent;
+		acked = (u32)f->acked;
+		nlost = (u32)f->lost;
+		f->sent -= nsent;
+		f->acked -= acked;
+		f->lost -= nlost;
+
+		/* lost packets go out again as retransmissions */
+		f->tp.segs_out += nsent + nlost;
+		f->tp.packets_out = f->tp.snd_cwnd;
+		f->delivered_bytes += (u64)acked * c->mss;
+		f->window_bytes += (u64)acked * c->mss;
+		s->sent_pkts += nsent;
+		s->lost_pkts += nlost;
+
+		if (acked || nlost)
+			sim_flow_ack(s, f, acked, nlost, rtt_us);
+	}
+
+	if (!sim_work_thread)
+		sim_run_work();
+}
+
+void sim_window_reset(struct sim *s)
+{
+	int i;
+
+	for (i = 0; i < s->nflows; i++)
+		s->flows[i].window_bytes = 0;
+	s->rtt_sum_us = 0;
+	s->rtt_samples = 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * sim.h - fluid-model bottleneck link that drives the tcpql control law.
+ *
+ * All flows share one FIFO bottleneck of bw_bps with a drop-tail buffer of
+ * buf_bytes behind a fixed propagation RTT. Every step of dt_us each flow
+ * offers cwnd * mss / rtt bytes per second (or its pacing rate, when that
+ * is lower), the queue integrates the excess over the link rate, and each
+ * flow gets its share of the delivered and dropped bytes. Whole packets
+ * that were delivered or lost during the step are reported to the
+ * congestion control as one aggregated ACK.
+ */
+#ifndef _TCPQL_SIM_H
+#define _TCPQL_SIM_H
+
+#include "tcp_shim.h"
+
+struct sim_link_cfg {
+	double	bw_bps;		/* bottleneck rate, bits per second */
+	double	rtt_us;		/* propagation round trip */
+	double	buf_bytes;	/* drop-tail buffer */
+	double	loss;		/* random loss probability per packet */
+	u32	mss;
+	u32	dt_us;		/* simulation step */
+};
+
+struct sim_flow {
+	struct tcp_sock	tp;		/* first, so &tp is the struct sock */
+	bool		open;
+	double		sent;		/* fractional packets not reported yet */
+	double		acked;
+	double		lost;
+	double		rate;		/* bytes per second offered this step */
+	u64		last_ack_us;
+	u64		recovery_until_us;
+	u64		delivered_bytes;	/* since open */
+	u64		window_bytes;		/* since the last sim_window_reset() */
+};
+
+struct sim {
+	struct sim_link_cfg	cfg;
+	struct sim_flow		*flows;
+	int			nflows;
+	double			queue;		/* bytes */
+	u64			steps;
+	double			rtt_sum_us;	/* for the mean RTT of a window */
+	u64			rtt_samples;
+	u64			lost_pkts;
+	u64			sent_pkts;
+};
+
+static inline struct sock *sim_sk(struct sim_flow *f)
+{
+	return (struct sock *)&f->tp;
+}
+
+/* module parameters by name, as insmod would set them */
+int sim_set_param(const char *name, const char *value);
+void sim_seed(u64 seed);
+
+/* net/tcpql sysctls of init_net by name, once the module is loaded */
+int sim_sysctl_set(const char *name, const char *value);
+
+/* debugfs files of the module: seq_file dumps and binary read/write */
+int sim_debugfs_show(const char *name, FILE *out);
+int sim_debugfs_save(const char *name, FILE *out);
+int sim_debugfs_load(const char *name, FILE *in);
+
+int sim_load(void);
+void sim_unload(void);
+
+int sim_init(struct sim *s, const struct sim_link_cfg *cfg, int nflows);
+void sim_free(struct sim *s);
+void sim_flow_open(struct sim *s, struct sim_flow *f);
+void sim_flow_close(struct sim *s, struct sim_flow *f);
+void sim_step(struct sim *s);
+
+/*
+ * Deferred work that is due, run by sim_step() unless sim_work_thread is
+ * set; then another thread calls it, as the kernel's workqueue would.
+ */
+extern bool sim_work_thread;
+void sim_run_work(void);
+void sim_window_reset(struct sim *s);
+double sim_current_rtt_us(const struct sim *s);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * tcp_shim.h - the slice of struct sock / tcp_sock / rate_sample that
+ * tcpql.c touches, laid out the way the kernel nests them so that
+ * tcp_sk(), inet_csk() and inet_csk_ca() are plain casts.
+ */
+#ifndef _TCPQL_TCP_SHIM_H
+#define _TCPQL_TCP_SHIM_H
+
+#include "kshim.h"
+
+#define ICSK_CA_PRIV_SIZE	(13 * sizeof(u64))
+#define TCP_INFINITE_SSTHRESH	0x7fffffff
+#define TCP_INIT_CWND		10
+#define TCP_CONG_NON_RESTRICTED	0x1
+#define TCP_CA_NAME_MAX		16
+
+enum tcp_ca_state {
+	TCP_CA_Open = 0,
+	TCP_CA_Disorder = 1,
+	TCP_CA_CWR = 2,
+	TCP_CA_Recovery = 3,
+	TCP_CA_Loss = 4,
+};
+
+#define AF_INET			2
+#define AF_INET6		10
+
+enum sk_pacing {
+	SK_PACING_NONE,
+	SK_PACING_NEEDED,
+	SK_PACING_FQ,
+};
+
+struct sock {
+	u16		sk_family;
+	__be32		sk_daddr;		/* IPv4 peer, network order */
+	unsigned long	sk_pacing_rate;		/* bytes per second */
+	unsigned long	sk_max_pacing_rate;
+	u32		sk_pacing_status;
+};
+
+struct inet_connection_sock {
+	struct sock	icsk_sk;
+	u8		icsk_ca_state;
+	u64		icsk_ca_priv[13];
+};
+
+struct tcp_sock {
+	struct inet_connection_sock inet_conn;
+	u32	snd_cwnd;
+	u32	snd_cwnd_clamp;
+	u32	prior_cwnd;
+	u32	segs_out;
+	u32	total_retrans;
+	u32	mss_cache;
+	u32	packets_out;
+	u32	sacked_out;
+	u32	lost_out;
+	u32	retrans_out;
+	u32	delivered;
+	u32	srtt_us;		/* smoothed RTT << 3 */
+	u32	min_rtt_us;		/* stands in for the rtt_min minmax filter */
+	u64	tcp_mstamp;		/* usec timestamp of the last ACK */
+};
+
+struct rate_sample {
+	u64	prior_mstamp;
+	u32	prior_delivered;
+	s32	delivered;
+	long	interval_us;
+	long	rtt_us;
+	int	losses;
+	u32	acked_sacked;
+	u32	prior_in_flight;
+	bool	is_app_limited;
+	bool	is_retrans;
+};
+
+struct tcp_congestion_ops {
+	u32	flags;
+	void	(*init)(struct sock *sk);
+	void	(*release)(struct sock *sk);
+	u32	(*ssthresh)(struct sock *sk);
+	void	(*cong_control)(struct sock *sk, const struct rate_sample *rs);
+	u32	(*undo_cwnd)(struct sock *sk);
+	char	name[TCP_CA_NAME_MAX];
+	struct module *owner;
+};
+
+static inline struct tcp_sock *tcp_sk(const struct sock *sk)
+{
+	return (struct tcp_sock *)sk;
+}
+
+static inline struct inet_connection_sock *inet_csk(const struct sock *sk)
+{
+	return (struct inet_connection_sock *)sk;
+}
+
+static inline void *inet_csk_ca(const struct sock *sk)
+{
+	return (void *)inet_csk(sk)->icsk_ca_priv;
+}
+
+static inline __be32 inet_make_mask(int logmask)
+{
+	return logmask ? cpu_to_be32(~((1U << (32 - logmask)) - 1)) : 0;
+}
+
+static inline u32 tcp_min_rtt(const struct tcp_sock *tp)
+{
+	return tp->min_rtt_us;
+}
+
+static inline u32 tcp_packets_in_flight(const struct tcp_sock *tp)
+{
+	return tp->packets_out - (tp->sacked_out + tp->lost_out) + tp->retrans_out;
+}
+
+static inline u64 tcp_clock_us(void)
+{
+	return READ_ONCE(sim_now_ns) / NSEC_PER_USEC;
+}
+
+/* one network namespace, init_net, which every socket belongs to */
+struct net { int unused; };
+extern struct net init_net;
+
+#define __net_init
+#define __net_exit
+
+static inline struct net *sock_net(const struct sock *sk)
+{
+	(void)sk;
+	return &init_net;
+}
+
+struct pernet_operations {
+	int		(*init)(struct net *net);
+	void		(*exit)(struct net *net);
+	unsigned int	*id;
+	size_t		size;
+};
+
+int register_pernet_subsys(struct pernet_operations *ops);
+void unregister_pernet_subsys(struct pernet_operations *ops);
+void *net_generic(const struct net *net, unsigned int id);
+struct ctl_table_header *register_net_sysctl_sz(struct net *net, const char *path,
+						struct ctl_table *table, size_t size);
+void unregister_net_sysctl_table(struct ctl_table_header *header);
+
+/* the simulator keeps a pointer to the registered ops */
+extern struct tcp_congestion_ops *sim_registered_ca;
+
+static inline int tcp_register_congestion_control(struct tcp_congestion_ops *ca)
+{
+	sim_registered_ca = ca;
+	return 0;
+}
+
+static inline void tcp_unregister_congestion_control(struct tcp_congestion_ops *ca)
+{
+	(void)ca;
+	sim_registered_ca = NULL;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * tcpql_sim.c - run tcpql flows over a simulated bottleneck and report
+ * throughput, delay and convergence.
+ *
+ *   ./tcpql-sim --bw-mbit 100 --rtt-ms 40 --buf-bdp 1 --flows 2 --time-s 60
+ *   ./tcpql-sim --param percpu_qtable=1 --seed 7
+ *   ./tcpql-sim --sysctl epsilon=9 --sysctl learning_rate=256
+ *   ./tcpql-sim --load-table warm.bin --save-table warm.bin --dump ring
+ */
+#include <getopt.h>
+#include <math.h>
+
+#include "sim.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --bw-mbit N      bottleneck rate in Mbit/s (100)\n"
+		"  --rtt-ms N       propagation RTT in ms (40)\n"
+		"  --buf-bdp N      buffer in bandwidth-delay products (1)\n"
+		"  --buf-kb N       buffer in KB, overrides --buf-bdp\n"
+		"  --loss P         random loss probability (0)\n"
+		"  --mss N          segment size in bytes (1448)\n"
+		"  --flows N        concurrent flows (1)\n"
+		"  --time-s N       simulated seconds (60)\n"
+		"  --dt-us N        simulation step (100)\n"
+		"  --report-ms N    per-flow report period, 0 for the summary only (1000)\n"
+		"  --seed N         seed for get_random_bytes (fixed by default)\n"
+		"  --param k=v      set a tcpql module parameter, repeatable\n"
+		"  --sysctl k=v     set a net.tcpql sysctl after loading, repeatable\n"
+		"  --load-table F   import a Q-table image before the flows start\n"
+		"  --save-table F   export the Q-table image at the end\n"
+		"  --dump NAME      print a debugfs file (ring, merge_stats, train_stats) at the end\n",
+		prog);
+}
+
+static void report(struct sim *s, double window_s)
+{
+	double rtt = s->rtt_samples ? s->rtt_sum_us / s->rtt_samples : 0;
+	int i;
+
+	printf("%8.3f", sim_now_ns / 1e9);
+	for (i = 0; i < s->nflows; i++)
+		printf("  f%d cwnd %6u %9.3f Mbit/s", i, s->flows[i].tp.snd_cwnd,
+		       s->flows[i].window_bytes * 8 / window_s / 1e6);
+	printf("  rtt %8.3f ms  queue %8.1f KB\n", rtt / 1e3, s->queue / 1024);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "bw-mbit",	required_argument, NULL, 'b' },
+		{ "rtt-ms",	required_argument, NULL, 'r' },
+		{ "buf-bdp",	required_argument, NULL, 'B' },
+		{ "buf-kb",	required_argument, NULL, 'k' },
+		{ "loss",	required_argument, NULL, 'l' },
+		{ "mss",	required_argument, NULL, 'm' },
+		{ "flows",	required_argument, NULL, 'n' },
+		{ "time-s",	required_argument, NULL, 't' },
+		{ "dt-us",	required_argument, NULL, 'd' },
+		{ "report-ms",	required_argument, NULL, 'R' },
+		{ "seed",	required_argument, NULL, 's' },
+		{ "param",	required_argument, NULL, 'p' },
+		{ "sysctl",	required_argument, NULL, 'y' },
+		{ "load-table",	required_argument, NULL, 'L' },
+		{ "save-table",	required_argument, NULL, 'S' },
+		{ "dump",	required_argument, NULL, 'D' },
+		{ "help",	no_argument,	   NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sim_link_cfg cfg = {
+		.bw_bps = 100e6, .rtt_us = 40000, .loss = 0, .mss = 1448, .dt_us = 100,
+	};
+	double buf_bdp = 1, buf_kb = -1, time_s = 60, report_ms = 1000;
+	double total_bytes = 0, sum = 0, sum_sq = 0, tput, conv_s = -1;
+	u64 steps, report_every, last_report_ns = 0, i;
+	const char *load_table = NULL, *save_table = NULL, *dump = NULL;
+	char *sysctls[32];
+	int nsysctls = 0;
+	struct sim s;
+	FILE *fp;
+	char *eq;
+	int nflows = 1, c, f, ret;
+
+	while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+		switch (c) {
+		case 'b': cfg.bw_bps = atof(optarg) * 1e6; break;
+		case 'r': cfg.rtt_us = atof(optarg) * 1e3; break;
+		case 'B': buf_bdp = atof(optarg); break;
+		case 'k': buf_kb = atof(optarg); break;
+		case 'l': cfg.loss = atof(optarg); break;
+		case 'm': cfg.mss = atoi(optarg); break;
+		case 'n': nflows = atoi(optarg); break;
+		case 't': time_s = atof(optarg); break;
+		case 'd': cfg.dt_us = atoi(optarg); break;
+		case 'R': report_ms = atof(optarg); break;
+		case 's': sim_seed(strtoull(optarg, NULL, 0)); break;
+		case 'p':
+			eq = strchr(optarg, '=');
+			if (!eq) {
+				usage(argv[0]);
+				return 2;
+			}
+			*eq = '\0';
+			ret = sim_set_param(optarg, eq + 1);
+			if (ret) {
+				fprintf(stderr, "bad parameter %s: %s\n", optarg, strerror(-ret));
+				return 2;
+			}
+			break;
+		case 'y':
+			if (!strchr(optarg, '=') || nsysctls == (int)ARRAY_SIZE(sysctls)) {
+				usage(argv[0]);
+				return 2;
+			}
+			sysctls[nsysctls++] = optarg;
+			break;
+		case 'L': load_table = optarg; break;
+		case 'S': save_table = optarg; break;
+		case 'D': dump = optarg; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	if (nflows < 1 || cfg.dt_us == 0 || cfg.mss == 0 || cfg.bw_bps <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	cfg.buf_bytes = buf_kb >= 0 ? buf_kb * 1024 : buf_bdp * cfg.bw_bps / 8 * cfg.rtt_us / 1e6;
+
+	ret = sim_load();
+	if (ret) {
+		fprintf(stderr, "module init failed: %d\n", ret);
+		return 1;
+	}
+	for (c = 0; c < nsysctls; c++) {
+		eq = strchr(sysctls[c], '=');
+		*eq = '\0';
+		ret = sim_sysctl_set(sysctls[c], eq + 1);
+		if (ret) {
+			fprintf(stderr, "bad sysctl %s: %s\n", sysctls[c], strerror(-ret));
+			return 2;
+		}
+	}
+	if (load_table) {
+		fp = fopen(load_table, "rb");
+		ret = fp ? sim_debugfs_load("qtable", fp) : -errno;
+		if (fp)
+			fclose(fp);
+		if (ret) {
+			fprintf(stderr, "cannot load %s: %s\n", load_table, strerror(-ret));
+			return 1;
+		}
+	}
+	if (sim_init(&s, &cfg, nflows))
+		return 1;
+	for (f = 0; f < nflows; f++)
+		sim_flow_open(&s, &s.flows[f]);
+
+	steps = (u64)(time_s * 1e6 / cfg.dt_us);
+	report_every = (u64)(report_ms * 1e6);
+	for (i = 0; i < steps; i++) {
+		sim_step(&s);
+		if (!report_every || sim_now_ns - last_report_ns < report_every)
+			continue;
+		tput = 0;
+		for (f = 0; f < nflows; f++)
+			tput += s.flows[f].window_bytes * 8 / (report_ms / 1e3);
+		if (conv_s < 0 && tput >= 0.9 * cfg.bw_bps)
+			conv_s = sim_now_ns / 1e9;
+		report(&s, report_ms / 1e3);
+		sim_window_reset(&s);
+		last_report_ns = sim_now_ns;
+	}
+
+	for (f = 0; f < nflows; f++) {
+		tput = s.flows[f].delivered_bytes * 8 / time_s;
+		total_bytes += s.flows[f].delivered_bytes;
+		sum += tput;
+		sum_sq += tput * tput;
+	}
+	printf("utilization %.3f  loss %.5f  jain %.3f  time-to-90%% %s%.3f s\n",
+	       total_bytes * 8 / time_s / cfg.bw_bps,
+	       s.sent_pkts ? (double)s.lost_pkts / s.sent_pkts : 0,
+	       sum_sq > 0 ? sum * sum / (nflows * sum_sq) : 0,
+	       conv_s < 0 ? ">" : "", conv_s < 0 ? time_s : conv_s);
+
+	sim_free(&s);
+	if (dump && sim_debugfs_show(dump, stdout))
+		fprintf(stderr, "no debugfs file %s\n", dump);
+	if (save_table) {
+		fp = fopen(save_table, "wb");
+		ret = fp ? sim_debugfs_save("qtable", fp) : -errno;
+		if (fp)
+			fclose(fp);
+		if (ret)
+			fprintf(stderr, "cannot save %s: %s\n", save_table, strerror(-ret));
+	}
+	sim_unload();
+	return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * tcpql_stress.c - open and close thousands of tcpql flows on one
+ * bottleneck, a few every step, under each table scope and training mode,
+ * and check that the shared table keeps its geometry and that every class
+ * table is referenced exactly by the flows and queued transitions using
+ * it, and that a new flow never inherits a closed flow's table. tcpql.c is
+ * included so its internals can be inspected; it exits non-zero if any
+ * check fails. Build it with -fsanitize=address to also catch use after
+ * free.
+ *
+ * Built with SIM_THREADS, as tcpql-stress-mt, the deferred work (training,
+ * merges, class table allocation) runs on its own thread while this one
+ * opens, closes and drives the flows, so refcounts, RCU publication and
+ * eviction race as they do in the kernel. The checks pause that thread.
+ *
+ *   make -C sim check
+ */
+#include "../tcpql.c"
+
+#include "sim.h"
+
+#ifdef SIM_THREADS
+#include <sched.h>
+#endif
+
+#define FLOWS		4096
+#define OPEN		(FLOWS / 8)	// at most, so classes fall idle and get evicted
+#define STEPS		20000
+#define CHURN		4		// flows opened or closed per step
+#define CHECK_EVERY	500
+
+struct stress_cfg {
+	const char	*scope;
+	const char	*budget_kb;
+	bool		offload;
+	const char	*replay_batch;
+	bool		percpu;
+	const char	*tilings;
+};
+
+static const struct stress_cfg cfgs[] = {
+	{ "global", "16384", false, "0",  false, "0" },
+	{ "global", "16384", true,  "16", true,  "0" },
+	{ "flow",   "16384", true,  "0",  false, "0" },
+	{ "prefix", "4096",  false, "0",  false, "0" },
+	{ "prefix", "4096",  true,  "16", true,  "0" },
+	{ "prefix", "4096",  true,  "16", true,  "4" },
+};
+
+static int failures;
+
+#define check(cond, fmt, ...)							\
+	do {									\
+		if (!(cond)) {							\
+			fprintf(stderr, "FAIL %s: " fmt "\n", #cond, ##__VA_ARGS__);	\
+			failures++;						\
+		}								\
+	} while (0)
+
+static Matrix geometry;		// the shared table as loaded
+
+static u64 stress_rng = 1;
+
+static u32 stress_rand(void)
+{
+	stress_rng ^= stress_rng << 13;
+	stress_rng ^= stress_rng >> 7;
+	stress_rng ^= stress_rng << 17;
+	return (u32)(stress_rng >> 32);
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void check_geometry(void)
+{
+	Matrix *m;
+	u8 i, b;
+
+	check(q_shared() == &q_buf[0] || q_shared() == &q_buf[1], "published %p", (void *)q_shared());
+	for (b = 0; b < ARRAY_SIZE(q_buf); b++) {
+		m = &q_buf[b];
+		check(m->col == geometry.col && m->num_state == geometry.num_state,
+		      "buffer %u: %u actions, %u dimensions", b, m->col, m->num_state);
+		for (i = 0; i < geometry.num_state; i++)
+			check(m->row[i] == geometry.row[i] && m->stride[i] == geometry.stride[i],
+			      "buffer %u dimension %u: %u bins, stride %u", b, i, m->row[i], m->stride[i]);
+	}
+}
+
+static struct { uintptr_t c; u32 refs; u32 flows; bool hashed; } found[FLOWS * 2];
+static u32 nfound;
+
+static void add_class(uintptr_t c, bool hashed)
+{
+	if (nfound == ARRAY_SIZE(found)) {
+		check(0, "more than %u classes", nfound);
+		return;
+	}
+	found[nfound].c = c;
+	found[nfound].refs = 0;
+	found[nfound].flows = 0;
+	found[nfound++].hashed = hashed;
+}
+
+/*
+ * every class is referenced by exactly its flows and queued transitions,
+ * and a flow table is hashed only while its own flow is open
+ */
+static void check_classes(struct sim *s)
+{
+	struct q_train_queue *q = q_train_queue ? this_cpu_ptr(q_train_queue) : NULL;
+	struct hlist_node *tmp;
+	struct q_class *c, *t;
+	struct Q_cong *qc;
+	u32 hashed, i, j;
+	int bkt;
+
+	nfound = 0;
+	hash_for_each_safe(q_class_hash, bkt, tmp, c, node)
+		add_class((uintptr_t)c, true);
+	qsort(found, nfound, sizeof(found[0]), cmp_ptr);
+	// a closed flow's table lives on, unhashed, in its queued transitions
+	if (q && q_scope == Q_SCOPE_FLOW) {
+		hashed = nfound;
+		for (j = q->tail; j != q->head; j++) {
+			uintptr_t key = (uintptr_t)q->t[j & (Q_TRAIN_QUEUE - 1)].table;
+
+			if (key && !bsearch(&key, found, hashed, sizeof(found[0]), cmp_ptr))
+				add_class(key, false);
+		}
+		qsort(found, nfound, sizeof(found[0]), cmp_ptr);
+		for (i = j = 0; i < nfound; i++)
+			if (!j || found[i].c != found[j - 1].c)
+				found[j++] = found[i];
+		nfound = j;
+	}
+	check(nfound == q_class_stats.classes, "%u classes found, %u counted", nfound, q_class_stats.classes);
+	check(q_class_stats.bytes <= (size_t)qtable_budget_kb << 10, "%zu bytes", q_class_stats.bytes);
+
+#define COUNT(ptr, what, is_flow)							\
+	do {										\
+		uintptr_t key = (uintptr_t)(ptr);					\
+		__typeof__(&found[0]) hit = bsearch(&key, found, nfound, sizeof(found[0]), cmp_ptr);	\
+		check(hit, "%s uses a freed class table", what);			\
+		if (hit) {								\
+			hit->refs++;							\
+			hit->flows += (is_flow);					\
+		}									\
+	} while (0)
+
+	for (i = 0; i < (u32)s->nflows; i++) {
+		if (!s->flows[i].open)
+			continue;
+		qc = inet_csk_ca(sim_sk(&s->flows[i]));
+		if (qc->table)
+			COUNT(qc->table, "flow", 1);
+	}
+	if (q) {
+		for (j = q->tail; j != q->head; j++) {
+			t = q->t[j & (Q_TRAIN_QUEUE - 1)].table;
+			if (t)
+				COUNT(t, "queued transition", 0);
+		}
+	}
+#undef COUNT
+
+	for (i = 0; i < nfound; i++) {
+		c = (struct q_class *)found[i].c;
+		check(refcount_read(&c->ref) == (int)found[i].refs,
+		      "class with %d references has %u users", refcount_read(&c->ref), found[i].refs);
+		check(list_empty(&c->lru) == (refcount_read(&c->ref) > 0),
+		      "class with %d references %s the LRU", refcount_read(&c->ref),
+		      list_empty(&c->lru) ? "off" : "on");
+		// the allocation work has run since the class was created
+		check(!refcount_read(&c->ref) || c->matrix.mat, "class in use has no table");
+		if (q_scope == Q_SCOPE_FLOW)
+			check(found[i].flows == found[i].hashed,
+			      "%s flow table has %u flows", found[i].hashed ? "hashed" : "unhashed", found[i].flows);
+	}
+}
+
+/*
+ * A new flow never inherits the table of a closed one at the same address.
+ * Only this thread creates classes, but the work thread may hold a
+ * reference, so the check is that the flow's class was just created.
+ */
+static void stress_open(struct sim *s, struct sim_flow *f)
+{
+	u64 created = q_class_stats.created;
+	struct Q_cong *qc;
+
+	sim_flow_open(s, f);
+	qc = inet_csk_ca(sim_sk(f));
+	if (q_scope == Q_SCOPE_FLOW && qc->table)
+		check(q_class_stats.created == created + 1,
+		      "new flow shares its table, %d references", refcount_read(&qc->table->ref));
+}
+
+#ifdef SIM_THREADS
+static pthread_mutex_t stress_work_lock = PTHREAD_MUTEX_INITIALIZER;	// held while work runs
+static pthread_t stress_worker;
+static bool stress_stop;
+
+static void *stress_work_fn(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&stress_work_lock);
+		sim_run_work();
+		pthread_mutex_unlock(&stress_work_lock);
+		sched_yield();
+	}
+	return NULL;
+}
+
+static void stress_threads_start(void)
+{
+	stress_stop = false;
+	sim_work_thread = true;
+	if (pthread_create(&stress_worker, NULL, stress_work_fn, NULL)) {
+		fprintf(stderr, "cannot start the work thread\n");
+		exit(1);
+	}
+}
+
+static void stress_threads_stop(void)
+{
+	__atomic_store_n(&stress_stop, true, __ATOMIC_RELEASE);
+	pthread_join(stress_worker, NULL);
+	sim_work_thread = false;
+	sim_run_work();
+}
+
+// the work thread is idle until stress_resume(), with the due work done
+static void stress_pause(void)
+{
+	pthread_mutex_lock(&stress_work_lock);
+	sim_run_work();
+}
+
+static void stress_resume(void)
+{
+	pthread_mutex_unlock(&stress_work_lock);
+}
+#else
+static void stress_threads_start(void) { }
+static void stress_threads_stop(void) { }
+static void stress_pause(void) { }
+static void stress_resume(void) { }
+#endif
+
+static void stress_one(const struct stress_cfg *cfg)
+{
+	struct sim_link_cfg link = {
+		.bw_bps = 10e9, .rtt_us = 2000, .mss = 1448, .dt_us = 100,
+	};
+	u64 opened = 0, closed = 0;
+	u32 open = 0;
+	struct sim_flow *f;
+	struct sim s;
+	u32 step, i;
+
+	link.buf_bytes = link.bw_bps / 8 * link.rtt_us / 1e6;
+	if (sim_set_param("qtable_scope", cfg->scope) ||
+	    sim_set_param("qtable_prefix4", "28") ||
+	    sim_set_param("qtable_budget_kb", cfg->budget_kb) ||
+	    sim_set_param("train_offload", cfg->offload ? "1" : "0") ||
+	    sim_set_param("replay_batch", cfg->replay_batch) ||
+	    sim_set_param("percpu_qtable", cfg->percpu ? "1" : "0") ||
+	    sim_set_param("tilings", cfg->tilings) ||
+	    sim_set_param("random_seed", "1") || sim_load()) {
+		fprintf(stderr, "module init failed\n");
+		exit(1);
+	}
+	geometry = *q_shared();
+	if (sim_init(&s, &link, FLOWS)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < FLOWS; i += FLOWS / OPEN, opened++, open++)
+		stress_open(&s, &s.flows[i]);
+
+	stress_threads_start();
+	for (step = 1; step <= STEPS; step++) {
+		for (i = 0; i < CHURN; i++) {
+			f = &s.flows[stress_rand() % FLOWS];
+			if (f->open) {
+				sim_flow_close(&s, f);
+				closed++;
+				open--;
+			} else if (open < OPEN) {
+				stress_open(&s, f);
+				opened++;
+				open++;
+			}
+		}
+		sim_step(&s);
+		if (step % CHECK_EVERY == 0) {
+			stress_pause();
+			check_geometry();
+			check_classes(&s);
+			stress_resume();
+		}
+	}
+	stress_threads_stop();
+
+	// with every flow gone only the queued transitions hold class tables
+	sim_free(&s);
+	s.nflows = 0;
+	check_classes(&s);
+	if (train_offload)
+		train_work_fn(NULL);
+	check_classes(&s);
+	if (q_scope == Q_SCOPE_FLOW)
+		check(q_class_stats.classes == 0, "%u flow tables left", q_class_stats.classes);
+
+	printf("%-6s offload %d replay %-2s percpu %d tilings %s: %6llu opened %6llu closed, "
+	       "classes %5llu created %5llu evicted %6llu fallbacks, %7llu trained\n",
+	       cfg->scope, train_offload, cfg->replay_batch, cfg->percpu, cfg->tilings,
+	       (unsigned long long)opened, (unsigned long long)closed,
+	       (unsigned long long)q_class_stats.created, (unsigned long long)q_class_stats.evicted,
+	       (unsigned long long)q_class_stats.fallbacks, (unsigned long long)train_stats.trained);
+	sim_unload();
+	check(q_class_stats.classes == 0 && q_class_stats.bytes == 0,
+	      "%u classes of %zu bytes left after unload", q_class_stats.classes, q_class_stats.bytes);
+	memset(&q_class_stats, 0, sizeof(q_class_stats));
+	memset(&train_stats, 0, sizeof(train_stats));
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	sim_seed(1);
+	for (i = 0; i < ARRAY_SIZE(cfgs); i++)
+		stress_one(&cfgs[i]);
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
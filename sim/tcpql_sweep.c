@@ -0,0 +1,181 @@
+/*
+ * tcpql_sweep.c - feed one tcpql flow synthetic rate samples at link rates
+ * from 1 Mbit/s to 400 Gbit/s and check that the throughput estimate, the
+ * reward, the pacing rate and the Q-values stay in range, i.e. that none
+ * of the rate arithmetic wraps. tcpql.c is included so its internals can
+ * be inspected; it exits non-zero on the first violation.
+ *
+ *   make -C sim check
+ */
+#include "../tcpql.c"
+#include <math.h>
+
+#include "sim.h"
+
+static const double rates_mbit[] = {
+	1, 10, 100, 1000, 10000, 25000, 40000, 100000, 200000, 400000,
+};
+static const u32 mss_sizes[] = { 1448, 8948 };
+
+#define RTT_US		10000
+#define DT_US		100
+#define RUN_US		(2 * USEC_PER_SEC)
+#define STARTUP_US	200000
+
+static int failures;
+
+#define check(cond, fmt, ...)							\
+	do {									\
+		if (!(cond)) {							\
+			fprintf(stderr, "FAIL %s: " fmt "\n", #cond, ##__VA_ARGS__);	\
+			failures++;						\
+		}								\
+	} while (0)
+
+/* one flow at rate_mbit, the rate swinging +-20% so the diff terms move */
+static void sweep_one(double rate_mbit, u32 mss, bool pace)
+{
+	struct tcp_sock tp;
+	struct sock *sk = (struct sock *)&tp;
+	struct Q_cong *qc;
+	struct rate_sample rs;
+	double rate_bps, frac = 0;
+	u64 start = sim_now_ns / NSEC_PER_USEC, now;
+	u32 flight[RTT_US / DT_US] = { 0 };	// tp.delivered one RTT ago, per step
+	u32 step = 0, prior;
+	u64 expect_kbps;
+	u32 pkts, i;
+	int reward;
+
+	memset(&tp, 0, sizeof(tp));
+	tp.snd_cwnd = TCP_INIT_CWND;
+	tp.snd_cwnd_clamp = ~0U;
+	tp.mss_cache = mss;
+	tp.min_rtt_us = RTT_US;
+	tp.srtt_us = RTT_US << 3;
+	tp.tcp_mstamp = start;
+	sk->sk_family = AF_INET;
+	sk->sk_max_pacing_rate = ~0UL;
+	pacing = pace;
+	q_cong.init(sk);
+	qc = inet_csk_ca(sk);
+
+	for (now = start + DT_US; now - start < RUN_US; now += DT_US) {
+		sim_now_ns = now * NSEC_PER_USEC;
+		rate_bps = rate_mbit * 1e6 * (1 + 0.2 * sin((now - start) / 1e5));
+		frac += rate_bps / 8 * DT_US / 1e6 / mss;
+		pkts = (u32)frac;
+		frac -= pkts;
+		tp.delivered += pkts;
+		prior = flight[step % ARRAY_SIZE(flight)];
+		flight[step++ % ARRAY_SIZE(flight)] = tp.delivered;
+		// ACKs only arrive with data
+		if (!pkts)
+			continue;
+
+		// as in the kernel, the sample spans the flight since the packet was sent
+		memset(&rs, 0, sizeof(rs));
+		rs.delivered = tp.delivered - prior;
+		rs.acked_sacked = pkts;
+		rs.interval_us = min_t(u64, RTT_US, now - start);
+		rs.rtt_us = RTT_US + (now / DT_US) % 7;
+		tp.segs_out += pkts;
+		tp.tcp_mstamp = now;
+		// one loss ends slow start after 200 ms
+		tp.inet_conn.icsk_ca_state = TCP_CA_Open;
+		if (qc->mode == STARTUP && now - start >= STARTUP_US) {
+			tp.inet_conn.icsk_ca_state = TCP_CA_Recovery;
+			rs.losses = 1;
+			tp.total_retrans++;
+		}
+		q_cong.cong_control(sk, &rs);
+
+		// the top of the swing, plus a packet per RTT of quantization
+		expect_kbps = (rate_mbit * 1.2e3 + (double)mss * 8 * USEC_PER_MSEC / RTT_US) * 1.05;
+		check(qc->estimated_throughput <= expect_kbps,
+		      "%.0f Mbit: estimate %u kbit/s", rate_mbit, qc->estimated_throughput);
+		check(qc->smooth_throughput <= expect_kbps,
+		      "%.0f Mbit: smoothed %u kbit/s", rate_mbit, qc->smooth_throughput);
+		if (pace)
+			check(sk->sk_pacing_rate <= (u64)(rate_mbit * 1.2e6 / 8 * 16) + q_cwnd_rate(sk) * 2,
+			      "%.0f Mbit: pacing %lu B/s", rate_mbit, sk->sk_pacing_rate);
+
+		reward = getRewardFromEnvironment(sk, &rs);
+		check(reward >= -60 && reward <= 60, "%.0f Mbit: reward %d", rate_mbit, reward);
+	}
+
+	// the filter settled on the top of the swing
+	check(qc->estimated_throughput >= (u64)(rate_mbit * 0.7e3),
+	      "%.0f Mbit: estimate %u kbit/s too low", rate_mbit, qc->estimated_throughput);
+
+	for (i = 0; i < q_size; i++)
+		check(abs(q_shared()->mat[i]) <= 16 * Q_CONG_SCALE,
+		      "%.0f Mbit: Q[%u] = %d", rate_mbit, i, (int)q_shared()->mat[i]);
+
+	q_cong.release(sk);
+	printf("%9.0f Mbit mss %5u pacing %d: estimate %10u kbit/s cwnd %8u\n",
+	       rate_mbit, mss, pace, qc->estimated_throughput, tp.snd_cwnd);
+}
+
+/* q_argmax against the obvious loop, ties to the last action */
+static void argmax_one(const int *Q, u32 n)
+{
+	int max = Q[0], min = Q[0], hi, lo;
+	u32 best = 0, i, got;
+
+	for (i = 1; i < n; i++) {
+		if (Q[i] >= max) {
+			max = Q[i];
+			best = i;
+		}
+		if (Q[i] < min)
+			min = Q[i];
+	}
+	got = q_argmax(Q, n, &hi, &lo);
+	check(got == best && hi == max && lo == min,
+	      "%u actions: argmax %u of %d..%d, expected %u of %d..%d", n, got, lo, hi, best, min, max);
+}
+
+int main(void)
+{
+	int Q[Q_MAX_ACTIONS];
+	unsigned int r, m, p;
+	u32 n, i;
+
+	// whatever the table holds, the estimator and reward must not wrap
+	check(softsignt(INT64_MAX / 16) == 9, "%d", softsignt(INT64_MAX / 16));
+	check(softsignt(-(INT64_MAX / 16)) == -9, "%d", softsignt(-(INT64_MAX / 16)));
+	check(softsign(-(INT64_MAX / 16)) == 0, "%d", softsign(-(INT64_MAX / 16)));
+	check(softsigntt(U32_MAX, U32_MAX) == 5, "%d", softsigntt(U32_MAX, U32_MAX));
+	check(q_saturate(INT64_MAX) == Q_VALUE_MAX, "saturate max");
+	check(q_saturate(INT64_MIN) == Q_VALUE_MIN, "saturate min");
+
+	// few distinct values so ties are common, plus the extremes
+	sim_seed(1);
+	for (r = 0; r < 100000; r++) {
+		n = 1 + r % Q_MAX_ACTIONS;
+		for (i = 0; i < Q_MAX_ACTIONS; i++)
+			Q[i] = r & 1 ? (int)get_random_u32() : (int)(get_random_u32() % 3) - 1;
+		if (r % 7 == 0)
+			Q[get_random_u32() % n] = r & 8 ? INT_MAX : INT_MIN;
+		argmax_one(Q, n);
+	}
+
+	sim_seed(1);
+	if (sim_set_param("random_seed", "1") || sim_load()) {
+		fprintf(stderr, "module init failed\n");
+		return 1;
+	}
+	for (p = 0; p < 2; p++)
+		for (m = 0; m < ARRAY_SIZE(mss_sizes); m++)
+			for (r = 0; r < ARRAY_SIZE(rates_mbit); r++)
+				sweep_one(rates_mbit[r], mss_sizes[m], p);
+	sim_unload();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
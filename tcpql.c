@@ -1,42 +1,431 @@
 #include <linux/module.h>
 #include <net/tcp.h>
 #include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+#include <linux/random.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/ctype.h>
+#include <linux/win_minmax.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/refcount.h>
+#include <linux/hashtable.h>
+#include <linux/inetdevice.h>
+#include <linux/cgroup.h>
+#include <net/ipv6.h>
+#include <linux/sysctl.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#define	Q_MAX_STATE	8		// state dimensions
+#define	Q_MAX_ENTRIES	(1 << 22)	// Q-values in the table
 
-#define numOfState	3
+#define	Q_CONG_SCALE	1024
 
-#define	state0_max	10	// throughput relative value
-#define	state1_max	19	// throughput diff value
-#define	state2_max	19	// rtt diff value
+/*
+ * Q-values are stored as int, or with TCPQL_Q16 as saturating s16. The
+ * 16-bit table is half the size and keeps the four actions of a state in
+ * one 8-byte word.
+ */
+#ifdef TCPQL_Q16
+typedef s16 q_value_t;
+#define	Q_VALUE_MIN	S16_MIN
+#define	Q_VALUE_MAX	S16_MAX
+#else
+typedef int q_value_t;
+#define	Q_VALUE_MIN	INT_MIN
+#define	Q_VALUE_MAX	INT_MAX
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "tcpql_trace.h"
+
+static const u32 min_training_interval_usec = 100;
+static const u32 max_training_interval_usec = 1000000;
+static const u32 max_probertt_duration_msecs = 200;
+static const u32 estimate_min_rtt_cwnd = 4;
 
-#define	Q_CONG_SCALE	1024
+static const char procname[] = "tcpql";
 
-#define	numOfAction	4
+/*
+ * Hyperparameters. The module parameters are what every network namespace
+ * starts with; /proc/sys/net/tcpql/ then tunes each namespace while its
+ * flows run, without reloading and losing the learned table.
+ */
+struct q_hparams{
+	unsigned int	learning_rate;		// of Q_CONG_SCALE
+	unsigned int	discount_factor;	// of 16
+	unsigned int	epsilon;		// greedy when a 0~9 draw is <= epsilon
+	unsigned int	training_interval_msec;	// epoch when training_rtts is 0
+	unsigned int	probertt_interval_msec;
+	unsigned int	alpha;			// reward weight of the throughput change
+	unsigned int	beta;			// of the delay change
+	unsigned int	delta;			// of the smoothed to current throughput
+	unsigned int	explore_halflife_sec;	// halves exploration, 0 never decays
+	unsigned int	explore_min_permille;	// where the decay stops
+	unsigned int	canary_permille;	// flows that explore, the rest exploit only
+	unsigned int	frozen;			// non-canary flows do not learn either
+	unsigned int	visit_lr;		// visits after which the learning rate halves, 0 keeps it
+	unsigned int	visit_bonus;		// optimism of a never tried action, in Q_CONG_SCALE
+};
 
-#define epsilon 8   // Explore parameters 0~9 <= epsilon
+static struct q_hparams q_hparams_default = {
+	.learning_rate		= 512,
+	.discount_factor	= 12,
+	.epsilon		= 8,
+	.training_interval_msec	= 100,
+	.probertt_interval_msec	= 10000,
+	.alpha			= 3,
+	.beta			= 1,
+	.delta			= 1,
+	.canary_permille	= 1000,
+};
 
-#define	sizeOfMatrix 	state0_max * state1_max * state2_max * numOfAction
+module_param_named(learning_rate, q_hparams_default.learning_rate, uint, 0444);
+MODULE_PARM_DESC(learning_rate, "Q-learning rate in 1/1024, 0~1024");
+module_param_named(discount_factor, q_hparams_default.discount_factor, uint, 0444);
+MODULE_PARM_DESC(discount_factor, "discount of the next state's value in 1/16, 0~15");
+module_param_named(epsilon, q_hparams_default.epsilon, uint, 0444);
+MODULE_PARM_DESC(epsilon, "greedy actions out of 10 are epsilon+1, 0~9");
+module_param_named(training_interval_msec, q_hparams_default.training_interval_msec, uint, 0444);
+MODULE_PARM_DESC(training_interval_msec, "training epoch in msec when training_rtts is 0, 1~10000");
+module_param_named(probertt_interval_msec, q_hparams_default.probertt_interval_msec, uint, 0444);
+MODULE_PARM_DESC(probertt_interval_msec, "period of the minimum RTT probe in msec, 10~3600000");
+module_param_named(alpha, q_hparams_default.alpha, uint, 0444);
+MODULE_PARM_DESC(alpha, "reward weight of the throughput change, 0~64");
+module_param_named(beta, q_hparams_default.beta, uint, 0444);
+MODULE_PARM_DESC(beta, "reward weight of the delay change, 0~64");
+module_param_named(delta, q_hparams_default.delta, uint, 0444);
+MODULE_PARM_DESC(delta, "reward weight of smoothed over current throughput, 0~64");
+module_param_named(explore_halflife_sec, q_hparams_default.explore_halflife_sec, uint, 0444);
+MODULE_PARM_DESC(explore_halflife_sec, "seconds after which exploration halves, 0 never decays");
+module_param_named(explore_min_permille, q_hparams_default.explore_min_permille, uint, 0444);
+MODULE_PARM_DESC(explore_min_permille, "exploration in 1/1000 the decay stops at, 0~1000");
+module_param_named(canary_permille, q_hparams_default.canary_permille, uint, 0444);
+MODULE_PARM_DESC(canary_permille, "flows in 1/1000 that explore, the others only exploit, 0~1000");
+module_param_named(frozen, q_hparams_default.frozen, uint, 0444);
+MODULE_PARM_DESC(frozen, "1 stops non-canary flows from updating the Q-table");
+module_param_named(visit_lr, q_hparams_default.visit_lr, uint, 0444);
+MODULE_PARM_DESC(visit_lr, "visits of an entry that halve its learning rate, 1/N decay, 0 keeps it constant");
+module_param_named(visit_bonus, q_hparams_default.visit_bonus, uint, 0444);
+MODULE_PARM_DESC(visit_bonus, "exploration bonus of canaries for rarely tried actions, in 1/1024 Q, 0~65536");
+
+static unsigned int q_hp_zero = 0;
+static unsigned int q_hp_one = 1;
+static unsigned int q_hp_ten = 10;
+static unsigned int q_hp_max_rate = Q_CONG_SCALE;
+static unsigned int q_hp_max_discount = 15;
+static unsigned int q_hp_max_epsilon = 9;
+static unsigned int q_hp_max_training = 10000;
+static unsigned int q_hp_max_probertt = 3600000;
+static unsigned int q_hp_max_weight = 64;
+static unsigned int q_hp_max_halflife = 365 * 24 * 3600;
+static unsigned int q_hp_permille = 1000;
+static unsigned int q_hp_max_visits = U16_MAX;
+static unsigned int q_hp_max_bonus = 64 * Q_CONG_SCALE;
+
+#define Q_HPARAM(name, min, max)					\
+	{								\
+		.procname	= #name,				\
+		.data		= &q_hparams_default.name,		\
+		.maxlen		= sizeof(unsigned int),			\
+		.mode		= 0644,					\
+		.proc_handler	= proc_douintvec_minmax,		\
+		.extra1		= &(min),				\
+		.extra2		= &(max),				\
+	}
 
-static const u32 probertt_interval_msec = 10000;
-static const u32 training_interval_msec = 100;
-static const u32 max_probertt_duration_msecs = 200;
-static const u32 estimate_min_rtt_cwnd = 4;
+// the template of every namespace's table, .data is rebased onto its q_net
+static struct ctl_table q_sysctl_table[] = {
+	Q_HPARAM(learning_rate, q_hp_zero, q_hp_max_rate),
+	Q_HPARAM(discount_factor, q_hp_zero, q_hp_max_discount),
+	Q_HPARAM(epsilon, q_hp_zero, q_hp_max_epsilon),
+	Q_HPARAM(training_interval_msec, q_hp_one, q_hp_max_training),
+	Q_HPARAM(probertt_interval_msec, q_hp_ten, q_hp_max_probertt),
+	Q_HPARAM(alpha, q_hp_zero, q_hp_max_weight),
+	Q_HPARAM(beta, q_hp_zero, q_hp_max_weight),
+	Q_HPARAM(delta, q_hp_zero, q_hp_max_weight),
+	Q_HPARAM(explore_halflife_sec, q_hp_zero, q_hp_max_halflife),
+	Q_HPARAM(explore_min_permille, q_hp_zero, q_hp_permille),
+	Q_HPARAM(canary_permille, q_hp_zero, q_hp_permille),
+	Q_HPARAM(frozen, q_hp_zero, q_hp_one),
+	Q_HPARAM(visit_lr, q_hp_zero, q_hp_max_visits),
+	Q_HPARAM(visit_bonus, q_hp_zero, q_hp_max_bonus),
+};
 
-static const u32 alpha = 200;
-static const u32 beta = 1;
-static const u32 delta = 1; 
+struct q_net{
+	struct q_hparams	hp;
+	struct ctl_table_header	*sysctl;
+};
 
-static const char procname[] = "tcpql";
+static unsigned int q_net_id;
+
+static const struct q_hparams *q_hp(const struct sock *sk){
+	return &((struct q_net *)net_generic(sock_net(sk), q_net_id))->hp;
+}
 
-static const u32 learning_rate = 512;
-static const u32 discount_factor = 12; 
+static int __net_init q_net_init(struct net *net){
+	struct q_net *qn = net_generic(net, q_net_id);
+	struct ctl_table *table;
+	int i;
+
+	qn -> hp = q_hparams_default;
+	table = kmemdup(q_sysctl_table, sizeof(q_sysctl_table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+	for(i=0; i<ARRAY_SIZE(q_sysctl_table); i++)
+		table[i].data += (char *)&qn->hp - (char *)&q_hparams_default;
+
+	qn -> sysctl = register_net_sysctl_sz(net, "net/tcpql", table, ARRAY_SIZE(q_sysctl_table));
+	if (!qn->sysctl){
+		kfree(table);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void __net_exit q_net_exit(struct net *net){
+	struct q_net *qn = net_generic(net, q_net_id);
+	const struct ctl_table *table = qn->sysctl->ctl_table_arg;
+
+	unregister_net_sysctl_table(qn->sysctl);
+	kfree(table);
+}
+
+static struct pernet_operations q_net_ops = {
+	.init	= q_net_init,
+	.exit	= q_net_exit,
+	.id	= &q_net_id,
+	.size	= sizeof(struct q_net),
+};
+
+// the module parameters get the bounds the sysctls enforce
+static int __init q_hparams_init(void){
+	unsigned int v;
+	int i;
+
+	for(i=0; i<ARRAY_SIZE(q_sysctl_table); i++){
+		v = *(unsigned int *)q_sysctl_table[i].data;
+		if (v < *(unsigned int *)q_sysctl_table[i].extra1 || v > *(unsigned int *)q_sysctl_table[i].extra2){
+			printk(KERN_ERR "tcpql: %s must be %u~%u", q_sysctl_table[i].procname,
+					*(unsigned int *)q_sysctl_table[i].extra1, *(unsigned int *)q_sysctl_table[i].extra2);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Per-CPU Q-table mode: each CPU accumulates its Q-value changes in a
+ * private delta shard and a delayed worker folds the shards into the
+ * shared table every merge_interval_msec.
+ */
+static bool percpu_qtable = false;
+module_param(percpu_qtable, bool, 0444);
+MODULE_PARM_DESC(percpu_qtable, "update per-CPU Q-table shards and merge them periodically");
+
+static unsigned int merge_interval_msec = 1000;
+module_param(merge_interval_msec, uint, 0644);
+MODULE_PARM_DESC(merge_interval_msec, "period of the per-CPU shard merge in msec");
+
+/*
+ * Exploration draws from a per-flow xorshift generator instead of the
+ * CRNG. A non-zero random_seed seeds flows deterministically, in the
+ * order they are created, so simulation runs can be repeated.
+ */
+static unsigned int random_seed = 0;
+module_param(random_seed, uint, 0644);
+MODULE_PARM_DESC(random_seed, "deterministic seed for the exploration PRNG, 0 seeds from the CRNG");
+
+static atomic_t flow_seq = ATOMIC_INIT(0);
+
+/*
+ * Training runs once per epoch of training_rtts minimum RTTs, timed in
+ * microseconds from tcp_mstamp, so a 200 us datacenter path and a 200 ms
+ * WAN path both decide at RTT scale. 0 keeps the fixed 100 ms epoch.
+ */
+static unsigned int training_rtts = 2;
+module_param(training_rtts, uint, 0644);
+MODULE_PARM_DESC(training_rtts, "training interval in minimum RTTs, 0 for a fixed 100 ms");
+
+/*
+ * Throughput is the delivery rate of the ACKs' rate samples, run through
+ * a windowed max filter over bw_filter_rtts minimum RTTs as BBR does, so
+ * retransmitted and lost data do not count as throughput.
+ */
+static unsigned int bw_filter_rtts = 10;
+module_param(bw_filter_rtts, uint, 0644);
+MODULE_PARM_DESC(bw_filter_rtts, "window of the delivery rate max filter in minimum RTTs");
+
+#define	Q_GAIN_SHIFT	8		// gains are in 1/256
+#define	Q_MAX_ACTIONS	8
+
+/*
+ * Built with GEOMETRY= the table geometry is a compile-time constant from
+ * tcpql_geometry.h (see tcpql_geometry.sh): states are indexed with
+ * constant strides and the actions of a state are padded to a power of
+ * two, so a state never straddles a cache line. The parameters default to
+ * that geometry and may only rename features and actions.
+ */
+#ifdef TCPQL_GEOMETRY
+#include "tcpql_geometry.h"
+#define	Q_COL_STRIDE	Q_GEO_COL_STRIDE
+#define	q_cols(m)	Q_GEO_NUM_ACTIONS
+#else
+#define	Q_COL_STRIDE	num_actions
+#define	q_cols(m)	((m)->col)
+#endif
+
+/*
+ * Actions. The action set is a load-time table: the original additive
+ * steps, multiplicative steps "x<gain>" (cwnd * gain) and BDP targets
+ * "bdp<gain>" (cwnd = gain * delivery rate * prop_rtt_us). Multiplicative
+ * steps reach a BDP of N segments in log(N) training intervals where the
+ * additive ones need N.
+ */
+enum q_action_kind{
+	ACT_ADD_RECIP,		// cwnd += arg / cwnd
+	ACT_ADD,		// cwnd += arg
+	ACT_MUL,		// cwnd *= arg >> Q_GAIN_SHIFT
+	ACT_BDP,		// cwnd = BDP * arg >> Q_GAIN_SHIFT
+};
+
+struct q_action{
+	u8	kind;
+	u32	arg;
+	u32	pacing_gain;	// the same action in pacing mode
+};
 
-enum action{
-	CWND_UP_30,
-	CWND_UP_1,
-	CWND_DOWN,
-    CWND_NOTHING,
+static const struct{
+	const char	*name;
+	struct q_action	action;
+} q_named_actions[] = {
+	{ "up_30",	{ ACT_ADD_RECIP, 30,  320 } },
+	{ "up_1",	{ ACT_ADD,	  1,  269 } },
+	{ "down",	{ ACT_MUL,	128,  192 } },
+	{ "nothing",	{ ACT_MUL,	256,  256 } },
 };
 
+#ifdef TCPQL_GEOMETRY
+static char *actions[Q_MAX_ACTIONS] = Q_GEO_ACTIONS;
+static int num_actions = Q_GEO_NUM_ACTIONS;
+#else
+static char *actions[Q_MAX_ACTIONS] = { "up_30", "up_1", "down", "nothing" };
+static int num_actions = 4;
+#endif
+module_param_array(actions, charp, &num_actions, 0444);
+MODULE_PARM_DESC(actions, "action set: up_30, up_1, down, nothing, x<gain> or bdp<gain>, e.g. x1.25,x1.05,x0.9,x0.5");
+
+// the action table resolved from the parameter at load time
+static struct q_action q_action[Q_MAX_ACTIONS];
+
+/*
+ * Pacing mode. Each action scales a pacing rate derived from the measured
+ * throughput by its pacing_gain instead of stepping cwnd, so data leaves spread over the RTT
+ * (by fq or TCP's internal pacing) rather than in line-rate bursts. cwnd
+ * then only caps inflight at pacing_cwnd_gain times the BDP of that rate.
+ */
+static bool pacing = false;
+module_param(pacing, bool, 0444);
+MODULE_PARM_DESC(pacing, "actions set the pacing rate, cwnd follows as a multiple of its BDP");
+
+static const u32 pacing_startup_gain = 512;	// as TCP paces slow start
+static const u32 pacing_cwnd_gain = 2;
+
+/*
+ * State space. Every dimension of the state is one feature of the flow
+ * quantized into a number of bins, and each state holds num_actions
+ * Q-values. The defaults are the relative throughput/rtt features with
+ * 10x19x19 states; "tput,rtt" with 100x100 bins is the absolute variant.
+ */
+enum q_feature{
+	FEAT_TPUT_REL,		// throughput relative to its smoothed value
+	FEAT_TPUT_DIFF,		// throughput minus its smoothed value
+	FEAT_RTT_DIFF,		// rtt change since the previous ACK
+	FEAT_TPUT,		// throughput
+	FEAT_RTT,		// rtt
+	FEAT_TPUT_LOG,		// log2 of throughput, 1 Mbit/s~100 Gbit/s
+	FEAT_RTT_LOG,		// log2 of rtt, 8 us~1 s
+	FEAT_LOSS,		// log2 of retransmits per packet this epoch
+	FEAT_INFLIGHT,		// packets in flight per BDP, 0~4
+	NUM_FEATURES,
+};
+
+struct q_feature_desc{
+	const char	*name;
+	u32		range;	// values the feature takes, 0 if it is unbounded
+	u32		bins;	// bins when state_bins is not given
+};
+
+static const struct q_feature_desc q_features[NUM_FEATURES] = {
+	[FEAT_TPUT_REL]		= { "tput_rel",	 10,  10 },
+	[FEAT_TPUT_DIFF]	= { "tput_diff", 19,  19 },
+	[FEAT_RTT_DIFF]		= { "rtt_diff",	 19,  19 },
+	[FEAT_TPUT]		= { "tput",	  0, 100 },
+	[FEAT_RTT]		= { "rtt",	  0, 100 },
+	[FEAT_TPUT_LOG]		= { "tput_log", 136,  68 },
+	[FEAT_RTT_LOG]		= { "rtt_log",	136,  68 },
+	[FEAT_LOSS]		= { "loss",	136,  17 },
+	[FEAT_INFLIGHT]		= { "inflight",	 32,  16 },
+};
+
+#ifdef TCPQL_GEOMETRY
+static char *state_features[Q_MAX_STATE] = Q_GEO_FEATURES;
+static int num_state_features = Q_GEO_NUM_STATE;
+#else
+static char *state_features[Q_MAX_STATE] = { "tput_rel", "tput_diff", "rtt_diff" };
+static int num_state_features = 3;
+#endif
+module_param_array(state_features, charp, &num_state_features, 0444);
+MODULE_PARM_DESC(state_features, "state dimensions: tput_rel, tput_diff, rtt_diff, tput, rtt, tput_log, rtt_log, loss, inflight");
+
+#ifdef TCPQL_GEOMETRY
+static unsigned int state_bins[Q_MAX_STATE] = Q_GEO_ROW;
+static int num_state_bins = Q_GEO_NUM_STATE;
+#else
+static unsigned int state_bins[Q_MAX_STATE];
+static int num_state_bins = 0;
+#endif
+module_param_array(state_bins, uint, &num_state_bins, 0444);
+MODULE_PARM_DESC(state_bins, "bins of each state dimension (1-255), default is the feature's own range");
+
+/*
+ * Function approximation. With tilings set, the Q-function is linear in
+ * tile-coded features instead of a dense table. Each state dimension is
+ * covered by `tilings` grids of tile_width bins, each offset from the
+ * last by tile_width / tilings. Q(s, a) is the sum of the weights of the
+ * tiles s falls in. The weights grow with the sum of the bins, not their
+ * product, and an update also moves the neighbouring states sharing a tile.
+ */
+#define	Q_MAX_TILINGS	8
+#define	Q_TILE_SHIFT	4		// fraction bits of a weight
+
+static unsigned int tilings = 0;
+module_param(tilings, uint, 0444);
+MODULE_PARM_DESC(tilings, "tile codings of each state dimension (1-8, at most tile_width), 0 keeps the dense Q-table");
+
+static unsigned int tile_width = 4;
+module_param(tile_width, uint, 0444);
+MODULE_PARM_DESC(tile_width, "state bins per tile of the tile codings (1-255)");
+
+// geometry resolved from the parameters at load time
+static u8 q_num_state;
+static u8 q_feature[Q_MAX_STATE];
+static u8 q_row[Q_MAX_STATE];
+static u32 q_size;
+static u32 q_tile_base[Q_MAX_STATE];	// first weight of each dimension's tilings
+static u16 q_tiles[Q_MAX_STATE];	// tiles in one tiling of each dimension
+
 enum q_cong_mode{
 	NOTHING,
 	TRAINING,
@@ -46,24 +435,183 @@ enum q_cong_mode{
 
 typedef struct{
 	u8  enabled;
-	int mat[sizeOfMatrix];	//本身就是int，为什么不存负值得效用函数呢？
-	u8 row[numOfState];
-	u8 col;
+	u8 num_state;
+	u8 row[Q_MAX_STATE];		// bins of each state dimension
+	u8 col;				// actions of each state
+	u32 stride[Q_MAX_STATE];	// entries between neighbours in a dimension
+	u32 size;
+	u8 sharded;			// deltas go through the per-CPU shards
+	q_value_t *mat;	//本身就是int，为什么不存负值得效用函数呢？
+	u16 *visit;			// updates of each entry, saturating
 }Matrix; 
 
-static Matrix matrix;
+/*
+ * The shared table is double buffered and published through q_table.
+ * Flows look it up under RCU and update the published buffer in place.
+ * Imports, and offloaded training of an unsharded table, fill the other
+ * buffer under q_table_mutex and publish it whole, so flows never index
+ * a half-installed table. Each buffer has its own visit counts, so they
+ * are published with the Q-values they belong to. Both buffers get their
+ * geometry once at load, it never changes under a reader.
+ */
+static Matrix q_buf[2];
+static Matrix __rcu *q_table;
+
+static DEFINE_PER_CPU(atomic_t *, q_shard);
+static DEFINE_PER_CPU(u16 *, q_visit_shard);	// visits not merged yet
+
+/*
+ * Q-table scope. "global" trains one table shared by every flow; "flow",
+ * "prefix" and "cgroup" give each flow, destination prefix or cgroup its
+ * own table, so bulk and interactive traffic learn separate policies.
+ * Class tables come from a slab cache when the first flow of the class
+ * starts. Tables no flow uses stay cached for the next flow of the class
+ * until qtable_budget_kb is reached, and then the least recently used is
+ * evicted; a flow that still finds no room uses the shared table.
+ */
+enum q_scope{
+	Q_SCOPE_GLOBAL,
+	Q_SCOPE_FLOW,
+	Q_SCOPE_PREFIX,
+	Q_SCOPE_CGROUP,
+	NUM_SCOPES,
+};
+
+static const char * const q_scope_names[NUM_SCOPES] = {
+	[Q_SCOPE_GLOBAL]	= "global",
+	[Q_SCOPE_FLOW]		= "flow",
+	[Q_SCOPE_PREFIX]	= "prefix",
+	[Q_SCOPE_CGROUP]	= "cgroup",
+};
+
+static char *qtable_scope = "global";
+module_param(qtable_scope, charp, 0444);
+MODULE_PARM_DESC(qtable_scope, "Q-table per global, flow, prefix (destination) or cgroup");
+
+static unsigned int qtable_prefix4 = 24;
+module_param(qtable_prefix4, uint, 0444);
+MODULE_PARM_DESC(qtable_prefix4, "IPv4 destination prefix length of the prefix scope");
+
+static unsigned int qtable_prefix6 = 64;
+module_param(qtable_prefix6, uint, 0444);
+MODULE_PARM_DESC(qtable_prefix6, "IPv6 destination prefix length of the prefix scope");
+
+static unsigned int qtable_budget_kb = 16384;
+module_param(qtable_budget_kb, uint, 0644);
+MODULE_PARM_DESC(qtable_budget_kb, "memory for class Q-tables in KB");
+
+static u8 q_scope;
+
+struct q_class{
+	struct hlist_node	node;		// in q_class_hash
+	struct list_head	lru;		// in q_class_lru while no flow uses it
+	struct list_head	pending;	// in q_class_pending until it has a table
+	u64			key[3];		// scope tag, then the flow/prefix/cgroup
+	refcount_t		ref;		// flows and queued transitions, 0 on the LRU
+	Matrix			matrix;		// mat is NULL until q_class_work fills it
+};
+
+struct q_class_stats{
+	u64	created;
+	u64	evicted;
+	u64	fallbacks;	// flows left on the shared table
+	u64	alloc_failed;	// table allocations to retry
+	u32	classes;
+	size_t	bytes;
+};
+
+static struct kmem_cache *q_class_cache;
+static DEFINE_HASHTABLE(q_class_hash, 8);
+static LIST_HEAD(q_class_lru);			// least recently used first
+static LIST_HEAD(q_class_pending);		// waiting for their table
+static DEFINE_SPINLOCK(q_class_lock);		// the hash, the lists and the stats
+static struct q_class_stats q_class_stats;
+
+struct merge_stats{
+	u64	merges;
+	u64	folded;		// entries changed by a merge
+	u64	last_ns;
+	u64	max_ns;
+	u64	total_ns;
+};
+
+static struct merge_stats merge_stats;
+static struct dentry *q_debugfs_dir;
+
+/*
+ * Per-CPU ring of learning-loop records, dumped by debugfs tcpql/ring.
+ * Recording is off unless trace_ring is set; the tracepoints in
+ * tcpql_trace.h are the zero-cost path when only live tracing is needed.
+ */
+#define	Q_RING_SIZE	512	// records per CPU, power of two
+
+static bool trace_ring = false;
+module_param(trace_ring, bool, 0644);
+MODULE_PARM_DESC(trace_ring, "record every Q-table update into the per-CPU debugfs ring");
+
+struct q_ring_rec{
+	u64	stamp_ns;
+	u32	flow;		// hash of the socket, tells flows apart
+	u8	state[Q_MAX_STATE];
+	u8	action;
+	int	reward;
+	int	qvalue;
+	u32	cwnd;
+};
+
+struct q_ring{
+	u32	head;
+	struct q_ring_rec rec[Q_RING_SIZE];
+};
+
+static struct q_ring __percpu *q_ring;
+
+/*
+ * Binary image of the Q-table served by debugfs tcpql/qtable, so a table
+ * learned on one host (or offline) can be loaded after insmod. All fields
+ * are little endian; the header is followed by one s32 per entry in table
+ * order, i.e. state-major with the actions of a state adjacent, or tile
+ * after tile when the table holds tile weights.
+ */
+#define	Q_TABLE_MAGIC		0x544c5154	// "TQLT"
+#define	Q_TABLE_VERSION		5
+#define	Q_TABLE_MAX_STATE	Q_MAX_STATE
+#define	Q_TABLE_MAX_ACTION	Q_MAX_ACTIONS
+
+struct q_table_hdr{
+	__le32	magic;
+	__le16	version;
+	__le16	hdr_size;
+	__le16	num_state;
+	__le16	num_action;
+	__le16	value_bits;
+	__le16	visit_bits;		// visit counts follow the values
+	__le16	tilings;		// 0 for a dense table, else the entries are tile weights
+	__le16	tile_width;
+	__le16	state_max[Q_TABLE_MAX_STATE];
+	u8	feature[Q_TABLE_MAX_STATE];	// enum q_feature of each dimension
+	__le32	action[Q_TABLE_MAX_ACTION];	// kind << 24 | arg of each action
+	__le32	entries;
+};
+
+struct q_table_file{
+	size_t	len;
+	size_t	size;
+	u8	buf[];
+};
+
+// serializes whole-table writers: shard merges and imports
+static DEFINE_MUTEX(q_table_mutex);
 
 struct Q_cong{
-	u64	alpha;
-	bool	forced_update;
-	
 	u32	mode:3,
 		exited:1,
-		unused:28;
-	u32 	last_sequence; 
+		canary:1,	// explores, see canary_permille
+		unused:27;
+	struct minmax bw;		// delivery rate in kbit/s, windowed max
 	u32	estimated_throughput;
 	u32 smooth_throughput;
-	u32	last_update_stamp;
+	u32	last_update_us;		// low bits of tcp_mstamp at the last training step
 	u32	last_packet_loss;
 	u32 	retransmit_during_interval; 
 
@@ -73,69 +621,1090 @@ struct Q_cong{
 	u32	prop_rtt_us;
 	u32	prior_cwnd;
 
-	u32	current_state[numOfState];
-	u32	prev_state[numOfState];
+	u8	current_state[Q_MAX_STATE];
+	u8	prev_state[Q_MAX_STATE];
 	u32 	action; 
+	u32	rnd;		// xorshift32 state, never 0
+	u32	last_delivered;	// tp->delivered at the start of the training epoch
+	struct q_class *table;	// class Q-table, NULL for the shared one
 };
 
 
-static int matrix_init = 0;
-static void createMatrix(Matrix *m, u8 *row, u8 col){
-	u32 i;
+// a decimal gain such as 1.25 in 1/256, at most 16
+static int __init q_parse_gain(const char *s, u32 *gain){
+	u32 whole = 0;
+	u32 frac = 0;
+	u32 scale = 1;
+
+	if (!isdigit(*s))
+		return -EINVAL;
+	while (isdigit(*s) && whole <= 16)
+		whole = whole * 10 + (*s++ - '0');
+	if (*s == '.')
+		for(s++; isdigit(*s) && scale < 10000; s++){
+			frac = frac * 10 + (*s - '0');
+			scale *= 10;
+		}
+	if (*s || whole > 16)
+		return -EINVAL;
+
+	*gain = (whole << Q_GAIN_SHIFT) + DIV_ROUND_CLOSEST(frac << Q_GAIN_SHIFT, scale);
+	return *gain ? 0 : -EINVAL;
+}
+
+static int __init q_actions_init(void){
+	struct q_action *a;
+	int i;
+	u8 n;
+
+	if (num_actions < 1 || num_actions > Q_MAX_ACTIONS)
+		return -EINVAL;
+
+	for(i=0; i<num_actions; i++){
+		a = &q_action[i];
+		for(n=0; n<ARRAY_SIZE(q_named_actions); n++)
+			if (!strcmp(actions[i], q_named_actions[n].name))
+				break;
+		if (n < ARRAY_SIZE(q_named_actions)){
+			*a = q_named_actions[n].action;
+			continue;
+		}
+
+		if (actions[i][0] == 'x' && !q_parse_gain(actions[i] + 1, &a->arg))
+			a -> kind = ACT_MUL;
+		else if (!strncmp(actions[i], "bdp", 3) && !q_parse_gain(actions[i] + 3, &a->arg))
+			a -> kind = ACT_BDP;
+		else{
+			printk(KERN_ERR "tcpql: unknown action %s", actions[i]);
+			return -EINVAL;
+		}
+		a -> pacing_gain = a->arg;
+	}
+	return 0;
+}
+
+/*
+ * Resolve state_features/state_bins/actions into the table geometry.
+ * Only called at module load, before any flow can use the table.
+ */
+static int __init q_geometry_init(void){
+#ifdef TCPQL_GEOMETRY
+	static const u8 geo_row[] = Q_GEO_ROW;
+#endif
+	u64 size;
+	unsigned int bins;
+	int ret;
+	int i;
+	u8 f;
+
+	if (num_state_features < 1 || num_state_features > Q_MAX_STATE)
+		return -EINVAL;
+	if (num_state_bins && num_state_bins != num_state_features){
+		printk(KERN_ERR "tcpql: %d state_bins given for %d state_features", num_state_bins, num_state_features);
+		return -EINVAL;
+	}
+	ret = q_actions_init();
+	if (ret)
+		return ret;
+
+	size = Q_COL_STRIDE;
+	for(i=0; i<num_state_features; i++){
+		for(f=0; f<NUM_FEATURES; f++)
+			if (!strcmp(state_features[i], q_features[f].name))
+				break;
+		if (f == NUM_FEATURES){
+			printk(KERN_ERR "tcpql: unknown state feature %s", state_features[i]);
+			return -EINVAL;
+		}
+		bins = num_state_bins ? state_bins[i] : q_features[f].bins;
+		if (bins < 1 || bins > 255){
+			printk(KERN_ERR "tcpql: %u bins for %s, must be 1~255", bins, state_features[i]);
+			return -EINVAL;
+		}
+		q_feature[i] = f;
+		q_row[i] = bins;
+		size *= bins;
+	}
+
+	// one block of weights per tile, instead of one block of Q-values per state
+	if (tilings){
+		if (tilings > Q_MAX_TILINGS || tile_width < 1 || tile_width > 255){
+			printk(KERN_ERR "tcpql: %u tilings of %u bins, must be 1~%d of 1~255", tilings, tile_width, Q_MAX_TILINGS);
+			return -EINVAL;
+		}
+		// offsets are multiples of tile_width / tilings bins, more grids repeat one
+		if (tilings > tile_width){
+			printk(KERN_ERR "tcpql: %u tilings of %u bins, at most one per bin", tilings, tile_width);
+			return -EINVAL;
+		}
+		size = 0;
+		for(i=0; i<num_state_features; i++){
+			q_tile_base[i] = size;
+			q_tiles[i] = (q_row[i] + tile_width - 2) / tile_width + 1;
+			size += (u64)tilings * q_tiles[i] * Q_COL_STRIDE;
+		}
+	}
+
+	if (size > Q_MAX_ENTRIES){
+		printk(KERN_ERR "tcpql: Q-table of %llu entries is too large", size);
+		return -EINVAL;
+	}
+
+#ifdef TCPQL_GEOMETRY
+	// the index arithmetic is compiled for these bins and actions
+	BUILD_BUG_ON(Q_GEO_SIZE > Q_MAX_ENTRIES);
+	if (num_state_features != Q_GEO_NUM_STATE || num_actions != Q_GEO_NUM_ACTIONS ||
+	    memcmp(q_row, geo_row, sizeof(geo_row))){
+		printk(KERN_ERR "tcpql: built for the geometry %s", Q_GEO);
+		return -EINVAL;
+	}
+#endif
+
+	q_num_state = num_state_features;
+	q_size = size;
+	return 0;
+}
+
+static int allocMatrix(Matrix *m, u32 size){
+	m -> mat = vzalloc(sizeof(q_value_t) * size);
+	m -> visit = vzalloc(sizeof(u16) * size);
+	if (!m->mat || !m->visit)
+		return -ENOMEM;
+	m -> size = size;
+	return 0;
+}
+
+static void freeMatrix(Matrix *m){
+	vfree(m->mat);
+	m -> mat = NULL;
+	vfree(m->visit);
+	m -> visit = NULL;
+	m -> size = 0;
+}
+
+static void createMatrix(Matrix *m, u8 *row, u8 num_state, u8 col){
+	int i;
 	
 	if (!m)
 		return;
 
 	m->col = col; 
+	m->num_state = num_state;
 
-	for(i=0; i<numOfState; i++)
+	for(i=0; i<num_state; i++)
 		*(m->row+i) = *(row+i);
 
-	// use matrix repeatedly
-	if(matrix_init == 0){
-		for(i=0; i<sizeOfMatrix; i++)
-			*(m->mat + i) = 0;
-		matrix_init = 1;
-	}
+	// the actions of a state are adjacent, then the last dimension varies fastest
+	m->stride[num_state-1] = Q_COL_STRIDE;
+	for(i=num_state-2; i>=0; i--)
+		m->stride[i] = m->stride[i+1] * m->row[i+1];
 
 	m -> enabled = 1; 
 }
 
-static void eraseMatrix(Matrix *m){
-	u8 i=0; 
-	if (!m)
-		return;
+static u32 getMatIndex(Matrix *m, const u8 *state, u8 col){
+#ifdef TCPQL_GEOMETRY
+	return q_geo_index(state, col);
+#else
+	// state[0] * row[1] * ... * row[n-1] * col + ... + state[n-1] * col + col
+	u32 index = col;
+	u8 i;
 
-	for(i=0; i<numOfState; i++)
-		*(m->row + i) = 0; 
+	for(i=0; i<m->num_state; i++)
+		index += state[i] * m->stride[i];
+	return index;
+#endif
+}
 
-	m -> col = 0; 
-	m -> enabled = 0; 
+static q_value_t q_saturate(s64 v){
+	return clamp_t(s64, v, Q_VALUE_MIN, Q_VALUE_MAX);
 }
 
-static void setMatValue(Matrix *m, u8 row1, u8 row2, u8 row3, u8 col, int v){
+/*
+ * Tile coding, see tilings. The weights of a tile are laid out as the
+ * Q-values of a state, so shards, merges, imports and class tables treat
+ * both alike; only these accessors tell them apart.
+ */
+// the first weight of the tile that tiling t of dimension d puts state in
+static u32 q_tile(const u8 *state, u8 d, u8 t){
+	u32 tile = (state[d] + t * tile_width / tilings) / tile_width;
+
+	return q_tile_base[d] + (t * q_tiles[d] + tile) * Q_COL_STRIDE;
+}
+
+static int q_tile_weight(Matrix *m, u32 index){
+	if (m->sharded)
+		return READ_ONCE(m->mat[index]) + atomic_read(this_cpu_read(q_shard) + index);
+	return READ_ONCE(m->mat[index]);
+}
+
+static void q_tile_values(Matrix *m, const u8 *state, int *Q){
+	s64 sum[Q_MAX_ACTIONS] = {0};
+	u32 base;
+	u8 d, t, i;
+
+	for(d=0; d<m->num_state; d++)
+		for(t=0; t<tilings; t++){
+			base = q_tile(state, d, t);
+			for(i=0; i<q_cols(m); i++)
+				sum[i] += q_tile_weight(m, base + i);
+		}
+	for(i=0; i<q_cols(m); i++)
+		Q[i] = q_saturate(sum[i] >> Q_TILE_SHIFT);
+}
+
+// moves Q(state, col) to v, spreading the change over the active weights
+static void q_tile_set(Matrix *m, const u8 *state, u8 col, int v){
+	int Q[Q_MAX_ACTIONS];
+	s64 delta;
+	u32 index;
+	u8 d, t;
+
+	q_tile_values(m, state, Q);
+	delta = div_s64(((s64)v - Q[col]) * (1 << Q_TILE_SHIFT), m->num_state * tilings);
+	for(d=0; d<m->num_state; d++)
+		for(t=0; t<tilings; t++){
+			index = q_tile(state, d, t) + col;
+			if (m->sharded)
+				atomic_add(delta, this_cpu_read(q_shard) + index);
+			else
+				WRITE_ONCE(m->mat[index], q_saturate(READ_ONCE(m->mat[index]) + delta));
+		}
+}
+
+/*
+ * Visit counts are statistics: increments from different CPUs may race
+ * and lose a count, which is cheaper than an atomic per update. A sharded
+ * table counts in this CPU's shard, folded in by merge_shards().
+ */
+static void q_visit_inc(Matrix *m, u32 index){
+	u16 *v = m->sharded ? this_cpu_read(q_visit_shard) + index : m->visit + index;
+	u16 n = READ_ONCE(*v);
+
+	if (n != U16_MAX)
+		WRITE_ONCE(*v, n + 1);
+}
+
+static u32 q_visit_count(Matrix *m, u32 index){
+	u32 n = READ_ONCE(m->visit[index]);
+
+	if (m->sharded)
+		n = min_t(u32, n + READ_ONCE(this_cpu_read(q_visit_shard)[index]), U16_MAX);
+	return n;
+}
+
+static void q_tile_visit(Matrix *m, const u8 *state, u8 col){
+	u8 d, t;
+
+	for(d=0; d<m->num_state; d++)
+		for(t=0; t<tilings; t++)
+			q_visit_inc(m, q_tile(state, d, t) + col);
+}
+
+// an action counts as tried in a state as often as its least tried tile
+static void q_tile_visits(Matrix *m, const u8 *state, u32 *N){
+	u32 base;
+	u8 d, t, i;
+
+	for(i=0; i<q_cols(m); i++)
+		N[i] = U16_MAX;
+	for(d=0; d<m->num_state; d++)
+		for(t=0; t<tilings; t++){
+			base = q_tile(state, d, t);
+			for(i=0; i<q_cols(m); i++)
+				N[i] = min_t(u32, N[i], q_visit_count(m, base + i));
+		}
+}
+
+static void setMatValue(Matrix *m, const u8 *state, u8 col, int v){
 	u32 index = 0; 
+	atomic_t *shard;
 	if (!m)
 		return;
-	// row1 * m->row[1] * m->row[2] + row2 * m->row[2] + row3
-	index = m->col * (row1 * m->row[1] * m->row[2] + row2 * m->row[2]  + row3 ) + col;
-	*(m -> mat + index) = v;
+	if (tilings){
+		q_tile_set(m, state, col, v);
+		return;
+	}
+
+	index = getMatIndex(m, state, col);
+
+	if (m->sharded){
+		/*
+		 * Only the delta against the shared value is kept locally. A
+		 * concurrent merge may take the delta away between the read and
+		 * the add, which is why the add is atomic and relative.
+		 */
+		shard = this_cpu_read(q_shard);
+		atomic_add(v - (READ_ONCE(m->mat[index]) + atomic_read(shard + index)), shard + index);
+		return;
+	}
+
+	WRITE_ONCE(m->mat[index], q_saturate(v));
+}
+
+static void addMatVisit(Matrix *m, const u8 *state, u8 col){
+	if (tilings){
+		q_tile_visit(m, state, col);
+		return;
+	}
+	q_visit_inc(m, getMatIndex(m, state, col));
+}
+
+static void getStateVisits(Matrix *m, const u8 *state, u32 *N){
+	u32 base;
+	u8 i;
+
+	if (tilings){
+		q_tile_visits(m, state, N);
+		return;
+	}
+	base = getMatIndex(m, state, 0);
+	for(i=0; i<q_cols(m); i++)
+		N[i] = q_visit_count(m, base + i);
+}
+
+/*
+ * Max, min and argmax of the n action values of a state, ties going to the
+ * last action. The winner is data dependent and a branch on it mispredicts
+ * on every decision, so every action is looked at with conditional moves.
+ * Q holds Q_MAX_ACTIONS values. The simulator build (TCPQL_SIMD) reduces
+ * them in one vector; the kernel keeps vector registers out of softirq.
+ */
+#if defined(TCPQL_SIMD) && defined(__GNUC__) && !defined(__clang__)
+typedef int q_vec_t __attribute__((vector_size(Q_MAX_ACTIONS * sizeof(int))));
+
+#define	q_vec_sel(mask, a, b)	(((mask) & (a)) | (~(mask) & (b)))
+
+// every lane of v becomes the max (or min) of v
+static void q_vec_reduce(q_vec_t *v, bool max){
+	static const q_vec_t swap[] = {
+		{ 4, 5, 6, 7, 0, 1, 2, 3 },
+		{ 2, 3, 0, 1, 6, 7, 4, 5 },
+		{ 1, 0, 3, 2, 5, 4, 7, 6 },
+	};
+	q_vec_t t;
+	u8 i;
+
+	for(i=0; i<ARRAY_SIZE(swap); i++){
+		t = __builtin_shuffle(*v, swap[i]);
+		*v = q_vec_sel(max ? *v > t : *v < t, *v, t);
+	}
+}
+
+static u32 q_argmax(const int *Q, u32 n, int *max, int *min){
+	static const q_vec_t lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	q_vec_t v, valid, hi, lo, best;
+
+	BUILD_BUG_ON(Q_MAX_ACTIONS != 8);
+	memcpy(&v, Q, sizeof(v));
+	// lanes past n repeat Q[0], which changes neither max nor min
+	valid = lane < (int)n;
+	v = q_vec_sel(valid, v, (q_vec_t){} + Q[0]);
+	hi = lo = v;
+	q_vec_reduce(&hi, true);
+	q_vec_reduce(&lo, false);
+	best = q_vec_sel(valid & (v == hi), lane, (q_vec_t){} - 1);
+	q_vec_reduce(&best, true);
+	*max = hi[0];
+	*min = lo[0];
+	return best[0];
 }
+#else
+static u32 q_argmax(const int *Q, u32 n, int *max, int *min){
+	int hi = Q[0], lo = Q[0];
+	u32 best = 0, i;
+	bool ge;
+
+	for(i=1; i<n; i++){
+		ge = Q[i] >= hi;
+		best = ge ? i : best;
+		hi = ge ? Q[i] : hi;
+		lo = Q[i] < lo ? Q[i] : lo;
+	}
+	*max = hi;
+	*min = lo;
+	return best;
+}
+#endif
 
-static int getMatValue(Matrix *m, u8 row1, u8 row2, u8 row3,  u8 col){
+static int getMatValue(Matrix *m, const u8 *state, u8 col){
+	int Q[Q_MAX_ACTIONS];
 	u32 index = 0; 
 	if (!m)
 		return -1; 
+	if (tilings){
+		q_tile_values(m, state, Q);
+		return Q[col];
+	}
+
+	index = getMatIndex(m, state, col);
 
-	index = m->col * (row1 * m->row[1] * m->row[2] + row2 * m->row[2]  + row3) + col;
+	if (m->sharded)
+		return READ_ONCE(m->mat[index]) + atomic_read(this_cpu_read(q_shard) + index);
 	
-	return *(m -> mat + index);
+	return READ_ONCE(m->mat[index]);
+}
+
+// the Q-values of every action of one state
+static void getStateValues(Matrix *m, const u8 *state, int *Q){
+	u32 base;
+	atomic_t *shard;
+	u8 i;
+#ifdef TCPQL_Q16
+	union{
+		u64	word;
+		s16	v[4];
+	} w;
+#endif
+
+	if (tilings){
+		q_tile_values(m, state, Q);
+		return;
+	}
+	base = getMatIndex(m, state, 0);
+#ifdef TCPQL_Q16
+
+	// four s16 actions of a state fill one aligned word, load them at once
+	if (q_cols(m) == 4){
+		w.word = READ_ONCE(*(u64 *)(m->mat + base));
+		for(i=0; i<4; i++)
+			Q[i] = w.v[i];
+	}
+	else
+#endif
+	for(i=0; i<q_cols(m); i++)
+		Q[i] = READ_ONCE(m->mat[base + i]);
+
+	if (m->sharded){
+		shard = this_cpu_read(q_shard) + base;
+		for(i=0; i<q_cols(m); i++)
+			Q[i] += atomic_read(shard + i);
+	}
+}
+
+// the published shared table, under rcu_read_lock() or q_table_mutex
+static Matrix *q_shared(void){
+	return rcu_dereference_check(q_table, lockdep_is_held(&q_table_mutex));
+}
+
+// the buffer that is not published, only touched under q_table_mutex
+static Matrix *q_back(void){
+	Matrix *m = rcu_dereference_protected(q_table, lockdep_is_held(&q_table_mutex));
+
+	return m == &q_buf[0] ? &q_buf[1] : &q_buf[0];
+}
+
+// the old buffer becomes the back one once no flow can still be using it
+static void q_publish(Matrix *m){
+	rcu_assign_pointer(q_table, m);
+	synchronize_rcu();
+}
+
+/*
+ * Fold every CPU's delta shard into the shared table. Deltas of CPUs that
+ * touched the same entry are averaged, since each of them was computed
+ * against the same shared value. Visits are summed.
+ */
+static void merge_shards(Matrix *m){
+	u64 start = ktime_get_ns();
+	u64 cost;
+	u32 visits;
+	u32 i;
+	u16 *v;
+	int cpu;
+	s64 sum;	// of many CPUs' deltas, each up to a whole Q-value
+	int n;
+	int d;
+
+	for(i=0; i<m->size; i++){
+		sum = 0;
+		n = 0;
+		visits = 0;
+		for_each_possible_cpu(cpu){
+			v = per_cpu(q_visit_shard, cpu) + i;
+			if (READ_ONCE(*v)){
+				visits += READ_ONCE(*v);
+				WRITE_ONCE(*v, 0);
+			}
+			d = atomic_xchg(per_cpu(q_shard, cpu) + i, 0);
+			if(d == 0)
+				continue;
+			sum += d;
+			n++;
+		}
+		if (visits)
+			WRITE_ONCE(m->visit[i], min_t(u32, m->visit[i] + visits, U16_MAX));
+		if(n == 0)
+			continue;
+		WRITE_ONCE(m->mat[i], q_saturate(m->mat[i] + div_s64(sum, n)));
+		merge_stats.folded++;
+	}
+
+	cost = ktime_get_ns() - start;
+	merge_stats.merges++;
+	merge_stats.last_ns = cost;
+	merge_stats.total_ns += cost;
+	if(cost > merge_stats.max_ns)
+		merge_stats.max_ns = cost;
+}
+
+static void merge_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(merge_work, merge_work_fn);
+
+static void merge_work_fn(struct work_struct *work){
+	mutex_lock(&q_table_mutex);
+	merge_shards(q_shared());
+	mutex_unlock(&q_table_mutex);
+	schedule_delayed_work(&merge_work, msecs_to_jiffies(max(merge_interval_msec, 1U)));
+}
+
+static void free_shards(void){
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		vfree(per_cpu(q_shard, cpu));
+		per_cpu(q_shard, cpu) = NULL;
+		vfree(per_cpu(q_visit_shard, cpu));
+		per_cpu(q_visit_shard, cpu) = NULL;
+	}
+}
+
+static int alloc_shards(void){
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		per_cpu(q_shard, cpu) = vzalloc(sizeof(atomic_t) * q_size);
+		per_cpu(q_visit_shard, cpu) = vzalloc(sizeof(u16) * q_size);
+		if(!per_cpu(q_shard, cpu) || !per_cpu(q_visit_shard, cpu)){
+			free_shards();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static int merge_stats_show(struct seq_file *seq, void *v){
+	seq_printf(seq, "merges: %llu\n", merge_stats.merges);
+	seq_printf(seq, "folded_entries: %llu\n", merge_stats.folded);
+	seq_printf(seq, "last_ns: %llu\n", merge_stats.last_ns);
+	seq_printf(seq, "max_ns: %llu\n", merge_stats.max_ns);
+	seq_printf(seq, "total_ns: %llu\n", merge_stats.total_ns);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(merge_stats);
+
+/*
+ * The image holds num_actions values per state whatever the build pads
+ * a state to, so images move between generic and GEOMETRY= builds.
+ */
+static u32 q_image_entries(void){
+	return q_size / Q_COL_STRIDE * num_actions;
+}
+
+// the table entry of image entry i
+static u32 q_image_index(u32 i){
+	return i / num_actions * Q_COL_STRIDE + i % num_actions;
+}
+
+static void qtable_fill_hdr(struct q_table_hdr *hdr){
+	u8 i;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr -> magic = cpu_to_le32(Q_TABLE_MAGIC);
+	hdr -> version = cpu_to_le16(Q_TABLE_VERSION);
+	hdr -> hdr_size = cpu_to_le16(sizeof(*hdr));
+	hdr -> num_state = cpu_to_le16(q_num_state);
+	hdr -> num_action = cpu_to_le16(num_actions);
+	hdr -> value_bits = cpu_to_le16(32);
+	hdr -> visit_bits = cpu_to_le16(16);
+	if (tilings){
+		hdr -> tilings = cpu_to_le16(tilings);
+		hdr -> tile_width = cpu_to_le16(tile_width);
+	}
+	for(i=0; i<q_num_state; i++){
+		hdr -> state_max[i] = cpu_to_le16(q_row[i]);
+		hdr -> feature[i] = q_feature[i];
+	}
+	for(i=0; i<num_actions; i++)
+		hdr -> action[i] = cpu_to_le32((u32)q_action[i].kind << 24 | q_action[i].arg);
+	hdr -> entries = cpu_to_le32(q_image_entries());
+}
+
+static void qtable_install(const __le32 *val){
+	const __le16 *visit = (const __le16 *)(val + q_image_entries());
+	Matrix *m;
+	atomic_t *shard;
+	u32 i, j;
+	int cpu;
+
+	mutex_lock(&q_table_mutex);
+	m = q_back();
+	for(i=0; i<q_image_entries(); i++){
+		j = q_image_index(i);
+		m -> mat[j] = q_saturate((s32)le32_to_cpu(val[i]));
+		m -> visit[j] = le16_to_cpu(visit[i]);
+		if (!percpu_qtable)
+			continue;
+		for_each_possible_cpu(cpu){
+			shard = per_cpu(q_shard, cpu);
+			atomic_set(shard + j, 0);
+			WRITE_ONCE(per_cpu(q_visit_shard, cpu)[j], 0);
+		}
+	}
+	q_publish(m);
+	mutex_unlock(&q_table_mutex);
+}
+
+static int qtable_open(struct inode *inode, struct file *file){
+	struct q_table_file *qf;
+	struct q_table_hdr *hdr;
+	Matrix *m;
+	__le32 *val;
+	__le16 *visit;
+	size_t size = sizeof(*hdr) + q_image_entries() * (sizeof(__le32) + sizeof(__le16));
+	u32 i, j;
+
+	if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+
+	qf = vzalloc(sizeof(*qf) + size);
+	if (!qf)
+		return -ENOMEM;
+	qf -> size = size;
+
+	// readers get a snapshot of the shared table taken at open
+	if (file->f_mode & FMODE_READ){
+		hdr = (struct q_table_hdr *)qf->buf;
+		qtable_fill_hdr(hdr);
+		val = (__le32 *)(hdr + 1);
+		visit = (__le16 *)(val + q_image_entries());
+		mutex_lock(&q_table_mutex);
+		m = q_shared();
+		for(i=0; i<q_image_entries(); i++){
+			j = q_image_index(i);
+			val[i] = cpu_to_le32(READ_ONCE(m->mat[j]));
+			visit[i] = cpu_to_le16(READ_ONCE(m->visit[j]));
+		}
+		mutex_unlock(&q_table_mutex);
+		qf -> len = size;
+	}
+
+	file->private_data = qf;
+	return 0;
+}
+
+static ssize_t qtable_read(struct file *file, char __user *buf, size_t count, loff_t *ppos){
+	struct q_table_file *qf = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, qf->buf, qf->len);
+}
+
+/*
+ * Imports are written sequentially. The header is checked against this
+ * module's geometry as soon as it is complete, and the table is installed
+ * when its last entry arrives; a short write leaves the table untouched.
+ */
+static ssize_t qtable_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos){
+	struct q_table_file *qf = file->private_data;
+	struct q_table_hdr expect;
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	if (pos != qf->len)
+		return -EINVAL;
+	if (count && pos >= qf->size)
+		return -EFBIG;
+
+	ret = simple_write_to_buffer(qf->buf, qf->size, ppos, buf, count);
+	if (ret <= 0)
+		return ret;
+	qf -> len = *ppos;
+
+	if (pos < sizeof(expect) && qf->len >= sizeof(expect)){
+		qtable_fill_hdr(&expect);
+		if (memcmp(qf->buf, &expect, sizeof(expect))){
+			qf -> len = 0;
+			*ppos = 0;
+			return -EINVAL;
+		}
+	}
+
+	if (qf->len == qf->size)
+		qtable_install((const __le32 *)(qf->buf + sizeof(expect)));
+
+	return ret;
+}
+
+static int qtable_release(struct inode *inode, struct file *file){
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations qtable_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qtable_open,
+	.read		= qtable_read,
+	.write		= qtable_write,
+	.release	= qtable_release,
+	.llseek		= default_llseek,
+};
+
+// the values, then the visit counts
+static size_t q_class_table_size(void){
+	return q_size * (sizeof(q_value_t) + sizeof(u16));
+}
+
+// what a class counts against qtable_budget_kb, its table included
+static size_t q_class_size(void){
+	return sizeof(struct q_class) + q_class_table_size();
+}
+
+// fills key with the class of the flow, false if it has none in this scope
+static bool q_class_key(struct sock *sk, u64 *key){
+#if IS_ENABLED(CONFIG_IPV6)
+	struct in6_addr prefix;
+#endif
+
+	memset(key, 0, sizeof(u64) * 3);
+	switch (q_scope){
+	case Q_SCOPE_FLOW:
+		key[1] = (unsigned long)sk;
+		return true;
+	case Q_SCOPE_PREFIX:
+#if IS_ENABLED(CONFIG_IPV6)
+		if (sk->sk_family == AF_INET6 && !ipv6_addr_v4mapped(&sk->sk_v6_daddr)){
+			ipv6_addr_prefix(&prefix, &sk->sk_v6_daddr, qtable_prefix6);
+			key[0] = AF_INET6;
+			memcpy(key + 1, &prefix, sizeof(prefix));
+			return true;
+		}
+#endif
+		key[0] = AF_INET;
+		key[1] = be32_to_cpu(sk->sk_daddr & inet_make_mask(qtable_prefix4));
+		return true;
+	case Q_SCOPE_CGROUP:
+#ifdef CONFIG_SOCK_CGROUP_DATA
+		key[1] = cgroup_id(sock_cgroup_ptr(&sk->sk_cgrp_data));
+		return true;
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+static u64 q_class_hash_key(const u64 *key){
+	return key[0] ^ key[1] ^ key[2];
+}
+
+// under q_class_lock kvfree() defers a vmalloc'ed table, bottom halves are off
+static void q_class_free(struct q_class *c){
+	hash_del(&c->node);
+	list_del_init(&c->lru);
+	list_del_init(&c->pending);
+	q_class_stats.classes--;
+	q_class_stats.bytes -= q_class_size();
+	kvfree(c->matrix.mat);
+	kmem_cache_free(q_class_cache, c);
+}
+
+static void q_class_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(q_class_work, q_class_work_fn);
+
+// called with q_class_lock held
+static void q_class_queue(struct q_class *c){
+	if (c->matrix.mat || !list_empty(&c->pending))
+		return;
+	list_add_tail(&c->pending, &q_class_pending);
+	schedule_delayed_work(&q_class_work, 0);
+}
+
+// called with q_class_lock held
+static struct q_class *q_class_create(const u64 *key){
+	size_t size = q_class_size();
+	struct q_class *c;
+
+	while (q_class_stats.bytes + size > (size_t)READ_ONCE(qtable_budget_kb) << 10){
+		if (list_empty(&q_class_lru))
+			return NULL;
+		q_class_free(list_first_entry(&q_class_lru, struct q_class, lru));
+		q_class_stats.evicted++;
+	}
+
+	// flows start from softirq when they are accepted: the table comes later
+	c = kmem_cache_zalloc(q_class_cache, GFP_ATOMIC);
+	if (!c)
+		return NULL;
+
+	memcpy(c->key, key, sizeof(c->key));
+	INIT_LIST_HEAD(&c->lru);
+	INIT_LIST_HEAD(&c->pending);
+	refcount_set(&c->ref, 1);
+	createMatrix(&c->matrix, q_row, q_num_state, num_actions);
+	c -> matrix.size = q_size;
+	hash_add(q_class_hash, &c->node, q_class_hash_key(key));
+	q_class_queue(c);
+	q_class_stats.created++;
+	q_class_stats.classes++;
+	q_class_stats.bytes += size;
+	return c;
+}
+
+// the Q-table of the flow's class, NULL to use the shared table
+static struct q_class *q_class_get(struct sock *sk){
+	struct q_class *c;
+	u64 key[3];
+
+	if (q_scope == Q_SCOPE_GLOBAL || !q_class_key(sk, key))
+		return NULL;
+
+	spin_lock_bh(&q_class_lock);
+	hash_for_each_possible(q_class_hash, c, node, q_class_hash_key(key)){
+		if (!memcmp(c->key, key, sizeof(key)))
+			goto found;
+	}
+	c = q_class_create(key);
+	if (!c)
+		q_class_stats.fallbacks++;
+	goto out;
+found:
+	// the last reference is only dropped under the lock, so 0 means the LRU
+	if (!refcount_inc_not_zero(&c->ref)){
+		refcount_set(&c->ref, 1);
+		list_del_init(&c->lru);
+	}
+	q_class_queue(c);
+out:
+	spin_unlock_bh(&q_class_lock);
+	return c;
+}
+
+// another reference for a holder of one, e.g. a transition queued for training
+static void q_class_hold(struct q_class *c){
+	if (c)
+		refcount_inc(&c->ref);
+}
+
+static void q_class_put(struct q_class *c){
+	if (!c)
+		return;
+
+	local_bh_disable();
+	if (refcount_dec_and_lock(&c->ref, &q_class_lock)){
+		// a flow's own table was unhashed when the flow was released
+		if (q_scope == Q_SCOPE_FLOW)
+			q_class_free(c);
+		else
+			list_add_tail(&c->lru, &q_class_lru);
+		spin_unlock(&q_class_lock);
+	}
+	local_bh_enable();
+}
+
+/*
+ * Allocates the tables of the pending classes. An idle class is dropped
+ * from the queue and queued again when a flow picks it up; a failed
+ * allocation is retried a second later, its flows meanwhile on the shared
+ * table.
+ */
+static void q_class_work_fn(struct work_struct *work){
+	struct q_class *c;
+	q_value_t *mat;
+	bool retry;
+
+	for(;;){
+		spin_lock_bh(&q_class_lock);
+		if (list_empty(&q_class_pending)){
+			spin_unlock_bh(&q_class_lock);
+			return;
+		}
+		c = list_first_entry(&q_class_pending, struct q_class, pending);
+		list_del_init(&c->pending);
+		if (c->matrix.mat || !refcount_inc_not_zero(&c->ref)){
+			spin_unlock_bh(&q_class_lock);
+			continue;
+		}
+		spin_unlock_bh(&q_class_lock);
+
+		mat = kvzalloc(q_class_table_size(), GFP_KERNEL);
+
+		retry = !mat;
+		spin_lock_bh(&q_class_lock);
+		if (retry){
+			q_class_stats.alloc_failed++;
+			if (list_empty(&c->pending))
+				list_add_tail(&c->pending, &q_class_pending);
+		} else if (!c->matrix.mat){
+			c -> matrix.visit = (u16 *)(mat + q_size);
+			// pairs with q_class_matrix(): flows see the zeroed table
+			smp_store_release(&c->matrix.mat, mat);
+			mat = NULL;
+		}
+		spin_unlock_bh(&q_class_lock);
+		q_class_put(c);
+		kvfree(mat);	// queued again and filled meanwhile
+
+		if (retry){
+			schedule_delayed_work(&q_class_work, HZ);
+			return;
+		}
+	}
+}
+
+// the class's own table once it is allocated, NULL until then
+static Matrix *q_class_matrix(struct q_class *c){
+	if (c && smp_load_acquire(&c->matrix.mat))
+		return &c->matrix;
+	return NULL;
 }
 
+/*
+ * A flow's table is keyed by its socket, whose slab address is soon reused:
+ * unhash it at release so queued transitions cannot hand it to a new flow.
+ */
+static void q_class_release(struct q_class *c){
+	if (c && q_scope == Q_SCOPE_FLOW){
+		spin_lock_bh(&q_class_lock);
+		hash_del(&c->node);
+		spin_unlock_bh(&q_class_lock);
+	}
+	q_class_put(c);
+}
+
+static int __init q_class_init(void){
+	u8 i;
+
+	for(i=0; i<NUM_SCOPES; i++)
+		if (!strcmp(qtable_scope, q_scope_names[i]))
+			break;
+	if (i == NUM_SCOPES){
+		printk(KERN_ERR "tcpql: unknown qtable_scope %s", qtable_scope);
+		return -EINVAL;
+	}
+	q_scope = i;
+	if (q_scope == Q_SCOPE_GLOBAL)
+		return 0;
+
+	if (q_scope == Q_SCOPE_CGROUP && !IS_ENABLED(CONFIG_SOCK_CGROUP_DATA)){
+		printk(KERN_ERR "tcpql: qtable_scope cgroup needs CONFIG_SOCK_CGROUP_DATA");
+		return -EINVAL;
+	}
+	if (qtable_prefix4 > 32 || qtable_prefix6 > 128){
+		printk(KERN_ERR "tcpql: qtable_prefix4 must be 0~32 and qtable_prefix6 0~128");
+		return -EINVAL;
+	}
+	q_class_cache = kmem_cache_create("tcpql_class", sizeof(struct q_class), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!q_class_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+// no flow is left once the module is unregistered
+static void q_class_exit(void){
+	struct hlist_node *tmp;
+	struct q_class *c;
+	int bkt;
+
+	if (!q_class_cache)
+		return;
+	cancel_delayed_work_sync(&q_class_work);
+	hash_for_each_safe(q_class_hash, bkt, tmp, c, node)
+		q_class_free(c);
+	kmem_cache_destroy(q_class_cache);
+	q_class_cache = NULL;
+}
+
+static int classes_show(struct seq_file *seq, void *v){
+	spin_lock_bh(&q_class_lock);
+	seq_printf(seq, "scope: %s\n", q_scope_names[q_scope]);
+	seq_printf(seq, "classes: %u\n", q_class_stats.classes);
+	seq_printf(seq, "bytes: %zu\n", q_class_stats.bytes);
+	seq_printf(seq, "budget_bytes: %zu\n", (size_t)READ_ONCE(qtable_budget_kb) << 10);
+	seq_printf(seq, "created: %llu\n", q_class_stats.created);
+	seq_printf(seq, "evicted: %llu\n", q_class_stats.evicted);
+	seq_printf(seq, "fallbacks: %llu\n", q_class_stats.fallbacks);
+	seq_printf(seq, "alloc_failed: %llu\n", q_class_stats.alloc_failed);
+	spin_unlock_bh(&q_class_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(classes);
+
+// the flow's class table, or the shared one until that is allocated
+static Matrix *q_matrix(struct Q_cong *qc){
+	Matrix *m = q_class_matrix(qc->table);
+
+	return m ? m : q_shared();
+}
+
+static void q_ring_record(struct sock *sk, u8 *state, u32 action, int reward, int qvalue){
+	struct q_ring *ring;
+	struct q_ring_rec *rec;
+	u8 i;
+
+	if (!trace_ring || !q_ring)
+		return;
+
+	// ACKs are processed from softirq and from process context on the same CPU
+	local_bh_disable();
+	ring = this_cpu_ptr(q_ring);
+	rec = &ring->rec[ring->head & (Q_RING_SIZE - 1)];
+	rec -> stamp_ns = ktime_get_ns();
+	rec -> flow = hash_ptr(sk, 32);
+	for(i=0; i<q_num_state; i++)
+		rec -> state[i] = state[i];
+	rec -> action = action;
+	rec -> reward = reward;
+	rec -> qvalue = qvalue;
+	rec -> cwnd = tcp_sk(sk) -> snd_cwnd;
+	ring -> head++;
+	local_bh_enable();
+}
+
+static int ring_show(struct seq_file *seq, void *v){
+	struct q_ring *ring;
+	struct q_ring_rec *rec;
+	u32 head;
+	u32 i;
+	u8 j;
+	int cpu;
+
+	seq_puts(seq, "# cpu stamp_ns flow state action reward qvalue cwnd\n");
+	for_each_possible_cpu(cpu){
+		ring = per_cpu_ptr(q_ring, cpu);
+		head = READ_ONCE(ring -> head);
+		// records can be overwritten while they are printed, this is a debugging aid
+		for(i = head > Q_RING_SIZE ? head - Q_RING_SIZE : 0; i != head; i++){
+			rec = &ring->rec[i & (Q_RING_SIZE - 1)];
+			seq_printf(seq, "%d %llu %08x ", cpu, rec->stamp_ns, rec->flow);
+			for(j=0; j<q_num_state; j++)
+				seq_printf(seq, j ? ",%u" : "%u", rec->state[j]);
+			seq_printf(seq, " %u %d %d %u\n", rec->action, rec->reward, rec->qvalue, rec->cwnd);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ring);
+
 static u32 q_cong_ssthresh(struct sock *sk){
 	return TCP_INFINITE_SSTHRESH; /* TCP Q-congestion does not use ssthresh */
 }
 
+// bytes per second the current cwnd sustains over one smoothed RTT
+static u64 q_cwnd_rate(struct sock *sk){
+	struct tcp_sock *tp = tcp_sk(sk);
+	u32 rtt = tp->srtt_us >> 3;
+
+	if (!rtt)
+		rtt = USEC_PER_MSEC;
+	return div_u64((u64)tp->snd_cwnd * tp->mss_cache * USEC_PER_SEC, rtt);
+}
+
+static void q_set_pacing_rate(struct sock *sk, u64 rate, u32 gain){
+	rate = (rate * gain) >> Q_GAIN_SHIFT;
+	WRITE_ONCE(sk->sk_pacing_rate, min_t(u64, rate, READ_ONCE(sk->sk_max_pacing_rate)));
+}
+
 static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 	struct Q_cong *qc = inet_csk_ca(sk);
 	struct tcp_sock *tp = tcp_sk(sk);
@@ -146,81 +1715,134 @@ static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 		}
 		else{
 			tp -> snd_cwnd += rs -> acked_sacked;
+			if (pacing)
+				q_set_pacing_rate(sk, q_cwnd_rate(sk), pacing_startup_gain);
 		}
 	}
 }
 
-static u32 epsilon_expore(u32 max_index){
-	u32 rand;
-	u32 rand2;
+static u32 q_random(struct Q_cong *qc){
+	u32 x = qc -> rnd;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	qc -> rnd = x;
+	return x;
+}
+
+static void q_random_seed(struct Q_cong *qc){
+	if (random_seed)
+		qc -> rnd = random_seed + atomic_inc_return(&flow_seq) * 0x9e3779b9;
+	else
+		qc -> rnd = get_random_u32();
+	if (qc -> rnd == 0)
+		qc -> rnd = 1;
+}
+
+/*
+ * Exploration schedule. epsilon gives the initial exploration, (9 - epsilon)
+ * in 10. It halves every explore_halflife_sec since the module was loaded,
+ * down to explore_min_permille. Only canary flows explore at all.
+ */
+static unsigned long q_explore_start;
+
+static u32 q_explore_permille(const struct q_hparams *hp){
+	u32 start = (9 - min(READ_ONCE(hp->epsilon), 9U)) * 100;
+	u32 floor = READ_ONCE(hp->explore_min_permille);
+	u32 halflife = READ_ONCE(hp->explore_halflife_sec);
+	unsigned long halvings;
+
+	if (!halflife || floor >= start)
+		return max(start, floor);
+	halvings = (jiffies - q_explore_start) / ((unsigned long)halflife * HZ);
+	return floor + ((start - floor) >> min(halvings, 31UL));
+}
+
+static u32 epsilon_expore(struct Q_cong *qc, u32 max_index, u32 explore){
 	u32 random_value;
-	get_random_bytes(&rand, sizeof(rand));
-	random_value = (rand%10); // 0~9
-	if(random_value <= epsilon)
+	random_value = reciprocal_scale(q_random(qc), 1000); // 0~999
+	if(random_value < 1000 - explore)
 		return max_index;
-	get_random_bytes(&rand2, sizeof(rand2));
-	return (rand2%numOfAction);
+	return reciprocal_scale(q_random(qc), num_actions);
 }
 
-int softsignt(int value){	// softsign for throughput while caculate reward
-	u32 remainder;
-	return (div_s64_rem(value*10, ((value<0?~(--value):value) + 2000), &remainder));		// -9~9 | 2000 is the best value for throughput diff
+/*
+ * The softsign helpers take s64 so that throughput differences of
+ * hundreds of Gbit/s (in kbit/s) neither overflow value*10 nor the
+ * denominator.
+ */
+int softsignt(s64 value){	// softsign for throughput while caculate reward
+	return div64_s64(value*10, abs(value) + 2000);		// -9~9 | 2000 is the best value for throughput diff
 }
 
-int softsignr(int value){	// softsign for rtt while caculate reward
-	u32 remainder;
-	return (div_s64_rem(value*10, ((value<0?~(--value):value) + 800), &remainder));		// -9~9 | 800 is the best value for delay diff
+int softsignr(s64 value){	// softsign for rtt while caculate reward
+	return div64_s64(value*10, abs(value) + 800);		// -9~9 | 800 is the best value for delay diff
 }
 
-int softsign(int value){    // softsign for others relative value in state
-	u32 remainder;
-	return (div_s64_rem(value*10, ((value<0?~(--value):value)+1000), &remainder)) + 9;		// 0-19 状态值
+int softsign(s64 value){    // softsign for others relative value in state
+	return div64_s64(value*10, abs(value) + 1000) + 9;		// 0-19 状态值
 }
 
-int softsigntt(int value, int smooth_throughput){	// softsign for throughput relative value in state
-	u32 remainder;
-	return div_s64_rem((value==0?1:value)*10, ((value==0?1:value) + smooth_throughput), &remainder);	// 0-9 状态值	smooth_throughout as parm
+int softsigntt(u64 value, u64 smooth_throughput){	// softsign for throughput relative value in state
+	value = max_t(u64, value, 1);
+	return div64_u64(value*10, value + smooth_throughput);	// 0-9 状态值	smooth_throughout as parm
 }
 
 
-static u32 getAction(struct sock *sk, const struct rate_sample *rs){
+/*
+ * Confidence in the Q-values of a state. Canaries add visit_bonus / sqrt(N)
+ * to each action, so rarely tried ones get tried. Other flows only pick
+ * among the actions tried in this state, if there are any, as the value
+ * of an untried one means nothing.
+ */
+static void q_visit_adjust(struct sock *sk, Matrix *m, const u8 *state, int *Q){
 	struct Q_cong *qc = inet_csk_ca(sk);
-
-	u32 Q[numOfAction];
+	u32 bonus = READ_ONCE(q_hp(sk)->visit_bonus);
+	u32 N[Q_MAX_ACTIONS];
+	bool tried = false;
 	u8 i;
-	u8 is_equal = 1;
-	u32 max_index = 0; 
-	u32 max_tmp = 0 ;
-	u32 rand;	
 
-	for(i=0; i<numOfAction; i++){
-		Q[i] = getMatValue(&matrix, qc -> current_state[0], qc->current_state[1], qc->current_state[2],i);
+	if (qc->canary && !bonus)
+		return;
+	getStateVisits(m, state, N);
+	for(i=0; i<num_actions; i++){
+		if (qc->canary)
+			Q[i] = q_saturate((s64)Q[i] + bonus / (1 + int_sqrt(N[i])));
+		tried |= N[i] != 0;
 	}
+	if (qc->canary || !tried)
+		return;
+	for(i=0; i<num_actions; i++)
+		if (!N[i])
+			Q[i] = INT_MIN;
+}
 
-	max_tmp = Q[0];
-	for(i=0; i<numOfAction; i++){
-		if(max_tmp == Q[i]){
-			max_index = i;
-			continue;
-		}
-		is_equal = 0;
-		if(max_tmp < Q[i]){
-			max_tmp = Q[i];
-			max_index = i;
-		}
-	}
-	
-	if(is_equal){
-		get_random_bytes(&rand, sizeof(rand));
-		max_index = (rand%numOfAction);
-	}
+static u32 getAction(struct sock *sk, const struct rate_sample *rs){
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	Matrix *m = q_matrix(qc);
+	int Q[Q_MAX_ACTIONS] = {0};
+	u32 max_index;
+	int max_tmp, min_tmp;
+
+	getStateValues(m, qc -> current_state, Q);
+	q_visit_adjust(sk, m, qc -> current_state, Q);
+
+	max_index = q_argmax(Q, num_actions, &max_tmp, &min_tmp);
+	// all equal, nothing learned here yet
+	if(max_tmp == min_tmp)
+		max_index = reciprocal_scale(q_random(qc), num_actions);
 
-	return epsilon_expore(max_index);
+	if (!qc->canary)
+		return max_index;
+	return epsilon_expore(qc, max_index, q_explore_permille(q_hp(sk)));
 }
 
 static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *rs){
 	//struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	const struct q_hparams *hp = q_hp(sk);
 	u32 retransmit_division_factor; 
     int diff_throughput;
     int diff_delay;
@@ -231,44 +1853,88 @@ static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *r
 	if(retransmit_division_factor == 0 || rs->rtt_us == 0)
 		return 0;
 	
-	diff_throughput = softsignt((int)(qc -> estimated_throughput - qc -> smooth_throughput));
-	diff_delay = softsignr((int)((rs -> rtt_us - qc -> min_rtt_us)-(qc -> pre_rtt - qc -> min_rtt_us)));	// measurement inaccuracy
-	smooth_divide_current_throughput =  (int)(qc -> smooth_throughput / (qc -> estimated_throughput==0?1:qc -> estimated_throughput)) > 20 ? 20 : (int)(qc -> smooth_throughput / (qc -> estimated_throughput==0?1:qc -> estimated_throughput));
+	diff_throughput = softsignt((s64)qc -> estimated_throughput - qc -> smooth_throughput);
+	diff_delay = softsignr((s64)rs -> rtt_us - qc -> pre_rtt);	// measurement inaccuracy
+	smooth_divide_current_throughput = min_t(u32, qc -> smooth_throughput / max(qc -> estimated_throughput, 1U), 20);
 
     /* 
 	 * Utility Function
 	 *
-	 * Utility = 3 * diff_throughput - diff_delay  - smooth_divide_current_throughput
+	 * Utility = alpha * diff_throughput - beta * diff_delay - delta * smooth_divide_current_throughput
 	 *
 	 */
 
-	result = 3 * diff_throughput - diff_delay - smooth_divide_current_throughput;
-	
-	printk(KERN_INFO "reward : %d", result);
+	result = (int)READ_ONCE(hp->alpha) * diff_throughput - (int)READ_ONCE(hp->beta) * diff_delay -
+		(int)READ_ONCE(hp->delta) * smooth_divide_current_throughput;
 	
 	return result;
 }
 
+// filtered delivery rate in bytes per second, the cwnd rate until there is one
+static u64 q_delivery_rate(struct sock *sk){
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u64 rate = (u64)minmax_get(&qc->bw) * 125;
+
+	return rate ? rate : q_cwnd_rate(sk);
+}
+
+// segments in flight that keep rate bytes per second over rtt_us
+static u64 q_bdp(struct sock *sk, u64 rate, u32 rtt_us){
+	return div64_u64(rate * max(rtt_us, 1U), USEC_PER_SEC * tcp_sk(sk)->mss_cache);
+}
+
+/*
+ * Pace at the delivery rate scaled by the action's gain. cwnd is sized
+ * from the rate and min_rtt_us so it never becomes the limit.
+ */
+static void executePacingAction(struct sock *sk, const struct rate_sample *rs){
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 rtt = min(qc->min_rtt_us, tp->srtt_us >> 3);
+	u64 bdp;
+
+	q_set_pacing_rate(sk, q_delivery_rate(sk), q_action[qc->action].pacing_gain);
+
+	bdp = q_bdp(sk, sk->sk_pacing_rate, rtt);
+	tp -> snd_cwnd = clamp_t(u64, bdp * pacing_cwnd_gain, estimate_min_rtt_cwnd, tp->snd_cwnd_clamp);
+}
+
 static void executeAction(struct sock *sk, const struct rate_sample *rs){
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	const struct q_action *a = &q_action[qc->action];
+	u64 cwnd = tp->snd_cwnd;
 
-	switch(qc -> action){
-		case CWND_UP_30:
-			tp -> snd_cwnd  = tp->snd_cwnd + 30/ (tp->snd_cwnd);
+	if (pacing){
+		executePacingAction(sk, rs);
+		return;
+	}
+
+	switch(a -> kind){
+		case ACT_ADD_RECIP:
+			cwnd += a->arg / tp->snd_cwnd;
 			break;
 
-		case CWND_UP_1:
-			tp -> snd_cwnd  = tp->snd_cwnd + 1;
+		case ACT_ADD:
+			cwnd += a->arg;
 			break;
 
-		case CWND_DOWN:
-			tp -> snd_cwnd = tp->snd_cwnd - (tp->snd_cwnd >> 1);
-			break; 
+		case ACT_MUL:
+			// a gain that rounds away on a small cwnd still moves it by one
+			cwnd = (cwnd * a->arg + (1 << (Q_GAIN_SHIFT - 1))) >> Q_GAIN_SHIFT;
+			if (a->arg > 1 << Q_GAIN_SHIFT)
+				cwnd = max_t(u64, cwnd, tp->snd_cwnd + 1);
+			else if (a->arg < 1 << Q_GAIN_SHIFT)
+				cwnd = min_t(u64, cwnd, tp->snd_cwnd - 1);
+			break;
 
-		default : 
+		case ACT_BDP:
+			cwnd = q_bdp(sk, q_delivery_rate(sk), min(qc->prop_rtt_us, tp->srtt_us >> 3));
+			cwnd = (cwnd * a->arg) >> Q_GAIN_SHIFT;
 			break;
 	}
+
+	tp -> snd_cwnd = clamp_t(u64, cwnd, 1, tp->snd_cwnd_clamp);
 }
 
 static u32 q_cong_undo_cwnd(struct sock* sk){
@@ -278,25 +1944,152 @@ static u32 q_cong_undo_cwnd(struct sock* sk){
 	return max(tp->snd_cwnd, tp->prior_cwnd);
 }
 
+// microseconds since the last training step, never 0 once the epoch expired
+static u32 q_elapsed_us(struct sock *sk){
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	return max((u32)tcp_sk(sk)->tcp_mstamp - qc->last_update_us, 1U);
+}
+
+static u32 q_training_interval_us(struct sock *sk){
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 rtts = READ_ONCE(training_rtts);
+
+	if (!rtts || !qc->min_rtt_us || qc->min_rtt_us == ~0U)
+		return READ_ONCE(q_hp(sk)->training_interval_msec) * USEC_PER_MSEC;
+	return clamp_t(u64, (u64)rtts * qc->min_rtt_us, min_training_interval_usec, max_training_interval_usec);
+}
+
+// retransmits per training_interval_msec, whatever the epoch length
 static void calc_retransmit_during_interval(struct sock* sk){
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	u64 retrans = tp -> total_retrans - qc -> last_packet_loss;
 
-	qc -> retransmit_during_interval = (tp -> total_retrans - qc -> last_packet_loss) * training_interval_msec / jiffies_to_msecs(tcp_jiffies32 - qc -> last_update_stamp);
+	qc -> retransmit_during_interval = div_u64(retrans * READ_ONCE(q_hp(sk)->training_interval_msec) * USEC_PER_MSEC, q_elapsed_us(sk));
 	qc -> last_packet_loss = tp -> total_retrans; 
+	qc -> last_delivered = tp -> delivered;
 }
 
-static void calc_throughput(struct sock *sk){
+/*
+ * Feed the ACK's delivery rate into the max filter. Samples taken while
+ * the flow was application limited only count when they raise the max,
+ * since they understate what the path can carry.
+ */
+static void update_bw(struct sock *sk, const struct rate_sample *rs){
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 win = USEC_PER_SEC;
+	u64 bw;
 
-	u32 segout_for_interval;
-	
-	segout_for_interval = (tp -> segs_out - qc ->last_sequence) * tp ->mss_cache; 
+	if (rs->delivered <= 0 || rs->interval_us <= 0)
+		return;
+
+	// bits per millisecond
+	bw = div64_u64((u64)rs->delivered * tp->mss_cache * 8 * USEC_PER_MSEC, rs->interval_us);
+	bw = min_t(u64, bw, U32_MAX);
+	if (rs->is_app_limited && bw < minmax_get(&qc->bw))
+		return;
 
-	qc -> estimated_throughput = segout_for_interval * 8 / jiffies_to_msecs(tcp_jiffies32 - qc -> last_update_stamp); 
+	if (qc->min_rtt_us && qc->min_rtt_us != ~0U)
+		win = min_t(u64, (u64)READ_ONCE(bw_filter_rtts) * qc->min_rtt_us, U32_MAX);
+	minmax_running_max(&qc->bw, win, (u32)tp->tcp_mstamp, bw);
+}
+
+static void calc_throughput(struct sock *sk){
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	qc -> estimated_throughput = minmax_get(&qc->bw);
 	qc -> smooth_throughput = ((7 * qc -> smooth_throughput)>>3) + ((qc -> estimated_throughput)>>3);		// 1/8
-	qc -> last_sequence = tp -> segs_out;
+}
+
+/*
+ * log2(v) in 1/8 octave steps: the octave from ilog2() and the three bits
+ * below the leading one, so bins are a constant ratio (~9%) apart.
+ */
+static int q_log2_8(u64 v){
+	int l;
+
+	if (v == 0)
+		return -1;
+	l = ilog2(v);
+	if (l >= 3)
+		return l * 8 + ((v >> (l - 3)) & 7);
+	return l * 8 + ((v << (3 - l)) & 7);
+}
+
+// retransmits per packet delivered so far this training epoch, in 1/65536 and at most 1
+static u32 q_loss_rate(struct sock *sk){
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 retrans = tp -> total_retrans - qc -> last_packet_loss;
+	u32 delivered = tp -> delivered - qc -> last_delivered;
+
+	if (!retrans)
+		return 0;
+	return min_t(u64, div_u64((u64)retrans << 16, max(delivered, 1U)), 1 << 16);
+}
+
+// packets in flight per BDP of the filtered rate, in 1/8, 0 until there is a rate
+static u32 q_inflight_bdp(struct sock *sk){
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u64 rate = (u64)minmax_get(&qc->bw) * 125;
+	u64 bdp8;
+
+	if (!rate)
+		return 0;
+	// the BDP in 1/8 segments, so small windows keep their resolution
+	bdp8 = q_bdp(sk, rate * 8, min(qc->prop_rtt_us, tp->srtt_us >> 3));
+	return min_t(u64, div64_u64((u64)tcp_packets_in_flight(tp) * 64, max_t(u64, bdp8, 1)), INT_MAX);
+}
+
+static int feature_value(struct sock *sk, u8 feature, int current_rtt){
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	switch(feature){
+		case FEAT_TPUT_REL:
+			return softsigntt(qc -> estimated_throughput, qc -> smooth_throughput);
+
+		case FEAT_TPUT_DIFF:
+			return softsign((s64)qc -> estimated_throughput - qc -> smooth_throughput);
+
+		case FEAT_RTT_DIFF:
+			return softsign((s64)current_rtt - qc-> pre_rtt);		// pre_rtt是比smoothrtt好的，但是这里的问题是一秒一取造成了pre很不准确
+
+		case FEAT_TPUT:
+			return qc -> estimated_throughput >> 9;		// 0~100M over 100 bins
+
+		case FEAT_RTT:
+			return current_rtt >> 10;			// 0~100ms over 100 bins
+
+		case FEAT_TPUT_LOG:
+			return q_log2_8(qc -> estimated_throughput) - 10 * 8;	// from 1024 kbit/s, 17 octaves
+
+		case FEAT_RTT_LOG:
+			return q_log2_8(max(current_rtt, 0)) - 3 * 8;		// from 8 us, 17 octaves
+
+		case FEAT_LOSS:
+			return q_log2_8(q_loss_rate(sk)) + 1;			// 0 without loss, 16 octaves up to 100%
+
+		case FEAT_INFLIGHT:
+			return q_inflight_bdp(sk);
+
+		default:
+			return 0;
+	}
+}
+
+// quantize a feature value into one of bins, keeping every state inside the table
+static u8 state_bin(u8 feature, int value, u32 bins){
+	u32 range = q_features[feature].range;
+
+	if (value < 0)
+		return 0;
+	if (range == 0)
+		return min_t(u32, value, bins - 1);
+	// softsigntt reaches 10 while smooth_throughput is still 0
+	return min_t(u32, value, range - 1) * bins / range;
 }
 
 static int update_state(struct sock *sk, const struct rate_sample *rs){
@@ -304,52 +2097,337 @@ static int update_state(struct sock *sk, const struct rate_sample *rs){
     int current_rtt;
 	u8 i; 
 
-	for (i=0; i<numOfState; i++)
+	for (i=0; i<q_num_state; i++)
 		qc -> prev_state[i] = qc -> current_state[i];
 	
-	qc -> current_state[0] = softsigntt((int)qc -> estimated_throughput, (int)qc -> smooth_throughput);
-	qc -> current_state[1] = softsign((int)(qc -> estimated_throughput - qc -> smooth_throughput));
 	current_rtt = rs->rtt_us;
-	qc -> current_state[2] = softsign((int)(current_rtt - qc-> pre_rtt));		// pre_rtt是比smoothrtt好的，但是这里的问题是一秒一取造成了pre很不准确
+	for (i=0; i<q_num_state; i++)
+		qc -> current_state[i] = state_bin(q_feature[i], feature_value(sk, q_feature[i], current_rtt), q_row[i]);
 	return current_rtt;
 }
 
-static void update_Qtable(struct sock *sk, const struct rate_sample *rs){
+// one observed step of a flow, with the learning parameters of its namespace
+struct q_transition{
+	struct q_class *table;	// holds a reference while queued, NULL for the shared table
+	u8	state[Q_MAX_STATE];
+	u8	next[Q_MAX_STATE];
+	u32	action;
+	int	reward;
+	u16	learning_rate;
+	u16	discount_factor;
+	u16	visit_lr;
+};
+
+static void q_transition_init(struct sock *sk, struct q_transition *t, int reward){
 	struct Q_cong *qc = inet_csk_ca(sk);
+	const struct q_hparams *hp = q_hp(sk);
+
+	// trained where it was looked up, so not in a class table still missing
+	t -> table = q_class_matrix(qc->table) ? qc->table : NULL;
+	memcpy(t->state, qc->prev_state, sizeof(t->state));
+	memcpy(t->next, qc->current_state, sizeof(t->next));
+	t -> action = qc->action;
+	t -> reward = reward;
+	t -> learning_rate = READ_ONCE(hp->learning_rate);
+	t -> discount_factor = READ_ONCE(hp->discount_factor);
+	t -> visit_lr = READ_ONCE(hp->visit_lr);
+}
 
-	u32 thisQ[numOfAction]; 
-	u32 newQ[numOfAction];
-	u8 i;
-	int updated_Qvalue;
-	int max_tmp; 
-	
-	for(i=0; i<numOfAction; i++){
-		thisQ[i] = getMatValue(&matrix, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], i);
-		newQ[i] = getMatValue(&matrix, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
+/*
+ * One TD update of the (state, action) entry towards reward plus the
+ * discounted best value of next:
+ * Q <- (1 - lr) * Q + lr * (reward + gamma * maxQ'), in signed 64-bit;
+ * the u32 hyperparameters used to turn negative Q-values into huge
+ * unsigned ones. With visit_lr the rate of an entry visited N times is
+ * lr * visit_lr / (visit_lr + N), so it converges where it is hot.
+ */
+static int q_learn(Matrix *m, const struct q_transition *t){
+	int thisQ[Q_MAX_ACTIONS] = {0};
+	int newQ[Q_MAX_ACTIONS] = {0};
+	u32 learning_rate = t->learning_rate;
+	u32 N[Q_MAX_ACTIONS];
+	int max_tmp, min_tmp;
+	s64 q;
+
+	getStateValues(m, t->state, thisQ);
+	getStateValues(m, t->next, newQ);
+	q_argmax(newQ, num_actions, &max_tmp, &min_tmp);
+
+	if (t->visit_lr && learning_rate){
+		getStateVisits(m, t->state, N);
+		learning_rate = max(learning_rate * t->visit_lr / (t->visit_lr + N[t->action]), 1U);
+	}
+
+	q = (s64)(Q_CONG_SCALE - learning_rate) * thisQ[t->action] +
+		(s64)learning_rate * (t->reward + (((s64)t->discount_factor * max_tmp) >> 4));
+	return q_saturate(q >> 10);
+}
+
+/*
+ * Offloaded training. With train_offload set the ACK path only computes
+ * the reward and queues (state, action, reward, next state) on a per-CPU
+ * queue; a worker drains the queues every replay_interval_msec, or as
+ * soon as one is half full, and does the TD updates. Each queue has one
+ * producer, its CPU with bottom halves off, and one consumer, the
+ * worker, so it needs no lock, only ordered head and tail updates. A
+ * full queue drops the transition rather than stall the ACK.
+ *
+ * The worker also keeps the last Q_REPLAY_SIZE transitions of the shared
+ * table and, after the fresh ones, replays replay_batch randomly drawn old
+ * ones, so each experience is learned from more than once. A transition
+ * of a class table holds a reference to it until it is trained.
+ */
+#define	Q_TRAIN_QUEUE	1024	// transitions queued per CPU, power of two
+#define	Q_REPLAY_SIZE	4096	// transitions kept for replay, power of two
+
+static bool train_offload = false;
+module_param(train_offload, bool, 0444);
+MODULE_PARM_DESC(train_offload, "update the Q-table in a worker, the ACK path only queues transitions");
+
+static unsigned int replay_batch = 0;
+module_param(replay_batch, uint, 0444);
+MODULE_PARM_DESC(replay_batch, "old transitions replayed per worker run, implies train_offload");
+
+static unsigned int replay_interval_msec = 100;
+module_param(replay_interval_msec, uint, 0644);
+MODULE_PARM_DESC(replay_interval_msec, "period of the training worker in msec");
+
+struct q_train_queue{
+	u32		head;		// written by this CPU's flows
+	u32		dropped;
+	u32		tail ____cacheline_aligned_in_smp;	// written by the worker
+	struct q_transition t[Q_TRAIN_QUEUE];
+};
+
+struct train_stats{
+	u64	runs;
+	u64	trained;	// fresh transitions
+	u64	replayed;	// old transitions drawn again
+};
+
+static struct q_train_queue __percpu *q_train_queue;
+static struct q_transition *q_replay;		// worker only
+static u32 q_replay_head;
+static struct train_stats train_stats;
+static u32 replay_rnd;
+
+static void train_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(train_work, train_work_fn);
+
+static void q_train_push(const struct q_transition *from){
+	struct q_train_queue *q;
+	struct q_transition *t;
+	u32 used;
+	u32 head;
+
+	local_bh_disable();
+	q = this_cpu_ptr(q_train_queue);
+	head = q->head;
+	// pairs with the worker's release of tail: it is done with the slot
+	used = head - smp_load_acquire(&q->tail);
+	if (used >= Q_TRAIN_QUEUE){
+		q -> dropped++;
+		local_bh_enable();
+		return;
+	}
+	t = &q->t[head & (Q_TRAIN_QUEUE - 1)];
+	*t = *from;
+	q_class_hold(t->table);
+	smp_store_release(&q->head, head + 1);
+	if (used == Q_TRAIN_QUEUE / 2)
+		mod_delayed_work(system_wq, &train_work, 0);
+	local_bh_enable();
+}
+
+static u32 replay_random(void){
+	replay_rnd ^= replay_rnd << 13;
+	replay_rnd ^= replay_rnd >> 17;
+	replay_rnd ^= replay_rnd << 5;
+	return replay_rnd;
+}
+
+// setMatValue() of a sharded table writes this CPU's shard: bottom halves off
+static void q_train_one(Matrix *m, const struct q_transition *t, bool visit){
+	setMatValue(m, t->state, t->action, q_learn(m, t));
+	if (visit)
+		addMatVisit(m, t->state, t->action);
+}
+
+// transitions queued, pairs with the release in q_train_push()
+static u32 q_train_pending(struct q_train_queue *q){
+	return smp_load_acquire(&q->head) - q->tail;
+}
+
+// trains the transitions queued so far, returns how many
+static u32 q_train_drain(Matrix *m, struct q_train_queue *q){
+	struct q_transition *t;
+	u32 head;
+	u32 tail;
+	u32 n;
+
+	// pairs with the release in q_train_push(): the slots are filled
+	head = smp_load_acquire(&q->head);
+	tail = q->tail;
+	n = head - tail;
+	local_bh_disable();
+	for(; tail != head; tail++){
+		t = &q->t[tail & (Q_TRAIN_QUEUE - 1)];
+		if (t->table){
+			q_train_one(&t->table->matrix, t, true);
+			q_class_put(t->table);
+			continue;
+		}
+		q_train_one(m, t, true);
+		if (replay_batch)
+			q_replay[q_replay_head++ & (Q_REPLAY_SIZE - 1)] = *t;
+	}
+	local_bh_enable();
+	smp_store_release(&q->tail, tail);
+	return n;
+}
+
+/*
+ * A sharded table is trained in place, through this CPU's shard. Else the
+ * run trains a copy in the back buffer and publishes it, so flows see all
+ * of a batch or none of it. A run with nothing queued or to replay leaves
+ * the table alone: no copy and no grace period on an idle host.
+ */
+static void train_work_fn(struct work_struct *work){
+	Matrix *m;
+	u32 trained = 0;
+	u32 pending = 0;
+	u32 replay = 0;
+	u32 stored;
+	u32 i;
+	int cpu;
+
+	mutex_lock(&q_table_mutex);
+	stored = min_t(u32, q_replay_head, Q_REPLAY_SIZE);
+	if (stored)
+		replay = replay_batch;
+	for_each_possible_cpu(cpu)
+		pending += q_train_pending(per_cpu_ptr(q_train_queue, cpu));
+	if (!pending && !replay)
+		goto out;
+
+	m = q_shared();
+	if (!m->sharded){
+		memcpy(q_back()->mat, m->mat, sizeof(q_value_t) * q_size);
+		memcpy(q_back()->visit, m->visit, sizeof(u16) * q_size);
+		m = q_back();
+	}
+	for_each_possible_cpu(cpu)
+		trained += q_train_drain(m, per_cpu_ptr(q_train_queue, cpu));
+	train_stats.trained += trained;
+
+	if (replay){
+		local_bh_disable();
+		for(i=0; i<replay; i++)
+			q_train_one(m, &q_replay[(q_replay_head - 1 - reciprocal_scale(replay_random(), stored)) & (Q_REPLAY_SIZE - 1)], false);
+		local_bh_enable();
+		train_stats.replayed += replay;
+	}
+	if (!m->sharded && (trained || replay))
+		q_publish(m);
+	train_stats.runs++;
+out:
+	mutex_unlock(&q_table_mutex);
+	schedule_delayed_work(&train_work, msecs_to_jiffies(max(replay_interval_msec, 1U)));
+}
+
+static int train_stats_show(struct seq_file *seq, void *v){
+	u64 dropped = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		dropped += READ_ONCE(per_cpu_ptr(q_train_queue, cpu)->dropped);
+	seq_printf(seq, "runs: %llu\n", train_stats.runs);
+	seq_printf(seq, "trained: %llu\n", train_stats.trained);
+	seq_printf(seq, "replayed: %llu\n", train_stats.replayed);
+	seq_printf(seq, "dropped: %llu\n", dropped);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(train_stats);
+
+static void free_train(void){
+	struct q_train_queue *q;
+	int cpu;
+	u32 i;
+
+	// an unhashed flow table is freed only by the transitions holding it
+	if (q_train_queue){
+		for_each_possible_cpu(cpu){
+			q = per_cpu_ptr(q_train_queue, cpu);
+			for(i=q->tail; i!=q->head; i++)
+				q_class_put(q->t[i & (Q_TRAIN_QUEUE - 1)].table);
+		}
+	}
+	free_percpu(q_train_queue);
+	q_train_queue = NULL;
+	vfree(q_replay);
+	q_replay = NULL;
+}
+
+static int __init alloc_train(void){
+	q_train_queue = alloc_percpu(struct q_train_queue);
+	if (replay_batch)
+		q_replay = vmalloc(sizeof(*q_replay) * Q_REPLAY_SIZE);
+	if (!q_train_queue || (replay_batch && !q_replay)){
+		free_train();
+		return -ENOMEM;
 	}
+	q_replay_head = 0;
+	replay_rnd = random_seed ? random_seed : get_random_u32();
+	if (!replay_rnd)
+		replay_rnd = 1;
+	return 0;
+}
+
+static void update_Qtable(struct sock *sk, const struct rate_sample *rs){
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct q_transition t;
+	int updated_Qvalue;
+	int reward;
+	Matrix *m;
+
+	reward = getRewardFromEnvironment(sk,rs);
+	q_transition_init(sk, &t, reward);
+	m = t.table ? &t.table->matrix : q_shared();
 
-	max_tmp = newQ[0];
-	for(i=0; i<numOfAction; i++){
-		if(max_tmp < newQ[i])
-			max_tmp = newQ[i]; 
+	/*
+	 * The training worker learns from it later; trace the value it starts
+	 * from. The updated value is not known here, so an offloaded flow never
+	 * takes the cwnd reset of an update to 0.
+	 */
+	if (train_offload){
+		q_train_push(&t);
+		if (trace_tcpql_update_enabled() || trace_ring){
+			updated_Qvalue = getMatValue(m, qc->prev_state, qc->action);
+			trace_tcpql_update(sk, qc->prev_state, q_num_state, qc->action, reward, updated_Qvalue);
+			q_ring_record(sk, qc->prev_state, qc->action, reward, updated_Qvalue);
+		}
+		return;
 	}
 
-	updated_Qvalue = ((Q_CONG_SCALE-learning_rate)*thisQ[qc ->action] +
-			(learning_rate * (getRewardFromEnvironment(sk,rs) + ((discount_factor * max_tmp)>>4))))>>10;
+	updated_Qvalue = q_learn(m, &t);
+
+	trace_tcpql_update(sk, qc->prev_state, q_num_state, qc->action, reward, updated_Qvalue);
+	q_ring_record(sk, qc->prev_state, qc->action, reward, updated_Qvalue);
 
 	if(updated_Qvalue == 0){
 		qc -> exited = 1; 
 		return;
 	}
 	
-	setMatValue(&matrix, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], qc->action, updated_Qvalue);
+	setMatValue(m, qc->prev_state, qc->action, updated_Qvalue);
+	addMatVisit(m, qc->prev_state, qc->action);
 }
 
 static void training(struct sock *sk, const struct rate_sample *rs){
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
 	
-	u32 training_timer_expired = after(tcp_jiffies32, qc -> last_update_stamp + msecs_to_jiffies(training_interval_msec)); 
+	u32 training_timer_expired = (u32)tp->tcp_mstamp - qc->last_update_us >= q_training_interval_us(sk);
 
 	if(training_timer_expired && qc -> mode == NOTHING){
 
@@ -365,12 +2443,16 @@ static void training(struct sock *sk, const struct rate_sample *rs){
 			return; 
 		}
 
-		update_Qtable(sk,rs);
+		// a frozen namespace only learns from its canaries
+		if (qc -> canary || !READ_ONCE(q_hp(sk)->frozen))
+			update_Qtable(sk,rs);
 execute:
-		printk(KERN_INFO "execute Action: %u", qc -> action);
 		qc -> action = getAction(sk,rs);
 		executeAction(sk, rs);
-		qc -> last_update_stamp = tcp_jiffies32; 
+		if (trace_tcpql_action_enabled())
+			trace_tcpql_action(sk, qc->current_state, q_num_state, qc->action,
+					getMatValue(q_matrix(qc), qc->current_state, qc->action), tp->snd_cwnd);
+		qc -> last_update_us = tp->tcp_mstamp;
 	}
 }
 
@@ -380,7 +2462,7 @@ static void update_min_rtt(struct sock *sk, const struct rate_sample* rs){
 	u32 estimate_rtt_expired; 
 
 	u32 update_filter_expired = after(tcp_jiffies32, 
-			qc -> last_probertt_stamp + msecs_to_jiffies(probertt_interval_msec));
+			qc -> last_probertt_stamp + msecs_to_jiffies(READ_ONCE(q_hp(sk)->probertt_interval_msec)));
 
 	if (rs -> rtt_us > 0){	
 		if (rs -> rtt_us < qc -> min_rtt_us){
@@ -415,8 +2497,11 @@ static void q_cong_main(struct sock *sk, const struct rate_sample *rs){
     int current_rtt;
 
 	reset_cwnd(sk, rs);
+	update_bw(sk, rs);
 	current_rtt = update_state(sk,rs);
+	rcu_read_lock();
 	training(sk, rs);
+	rcu_read_unlock();
 	qc -> pre_rtt = current_rtt;
 	update_min_rtt(sk,rs);
 }
@@ -426,17 +2511,17 @@ static void q_cong_main(struct sock *sk, const struct rate_sample *rs){
 static void init_Q_cong(struct sock *sk){
 	struct Q_cong *qc;
 	struct tcp_sock *tp = tcp_sk(sk);
-	u8 Q_row[numOfState] = {state0_max, state1_max, state2_max};
-	u8 Q_col = numOfAction; 
+	u32 canary;
 
 	qc = inet_csk_ca(sk);
 
 	qc -> mode = STARTUP;
-	qc -> last_sequence = 0;
+	minmax_reset(&qc->bw, tcp_clock_us(), 0);
 	qc -> estimated_throughput = 0;
 	qc -> smooth_throughput = 0;
-	qc -> last_update_stamp = tcp_jiffies32;
+	qc -> last_update_us = tcp_clock_us();
 	qc -> last_packet_loss = 0;
+	qc -> last_delivered = tp -> delivered;
 
 	qc -> last_probertt_stamp = tcp_jiffies32;
 	qc -> min_rtt_us = tcp_min_rtt(tp);
@@ -447,18 +2532,25 @@ static void init_Q_cong(struct sock *sk){
 
 	qc -> action = -1; 
 	qc -> exited = 0; 
-	qc -> prev_state[0] = 0;
-	qc -> prev_state[1] = 0; 
-	qc -> prev_state[2] = 0;
-	qc -> current_state[0] = 0;
-	qc -> current_state[1] = 0;
-	qc -> current_state[2] = 0;
+	memset(qc -> prev_state, 0, sizeof(qc -> prev_state));
+	memset(qc -> current_state, 0, sizeof(qc -> current_state));
+	q_random_seed(qc);
+	canary = READ_ONCE(q_hp(sk)->canary_permille);
+	qc -> canary = canary >= 1000 || reciprocal_scale(q_random(qc), 1000) < canary;
+
+	if (pacing){
+		cmpxchg(&sk->sk_pacing_status, SK_PACING_NONE, SK_PACING_NEEDED);
+		q_set_pacing_rate(sk, q_cwnd_rate(sk), pacing_startup_gain);
+	}
 
-	createMatrix(&matrix, Q_row, Q_col);
+	qc -> table = q_class_get(sk);
 }
 
 static void release_Q_cong(struct sock* sk){
-	eraseMatrix(&matrix);
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	q_class_release(qc->table);
+	qc -> table = NULL;
 }
 
 struct tcp_congestion_ops q_cong = {
@@ -473,12 +2565,113 @@ struct tcp_congestion_ops q_cong = {
 };
 
 static int __init Q_cong_init(void){
+	int ret;
+	int i;
+
 	BUILD_BUG_ON(sizeof(struct Q_cong) > ICSK_CA_PRIV_SIZE);
-	return tcp_register_congestion_control(&q_cong);
+
+	ret = q_geometry_init();
+	if (ret)
+		return ret;
+	ret = q_hparams_init();
+	if (ret)
+		return ret;
+	q_explore_start = jiffies;
+
+	for(i=0; i<ARRAY_SIZE(q_buf); i++){
+		ret = allocMatrix(&q_buf[i], q_size);
+		if (ret)
+			goto err_matrix;
+		createMatrix(&q_buf[i], q_row, q_num_state, num_actions);
+		q_buf[i].sharded = percpu_qtable;
+	}
+	RCU_INIT_POINTER(q_table, &q_buf[0]);
+
+	ret = q_class_init();
+	if (ret)
+		goto err_matrix;
+
+	q_ring = alloc_percpu(struct q_ring);
+	if (!q_ring){
+		ret = -ENOMEM;
+		goto err_class;
+	}
+
+	if (percpu_qtable){
+		ret = alloc_shards();
+		if (ret)
+			goto err_ring;
+	}
+
+	if (replay_batch)
+		train_offload = true;
+	if (train_offload){
+		ret = alloc_train();
+		if (ret)
+			goto err_shards;
+	}
+
+	q_debugfs_dir = debugfs_create_dir(procname, NULL);
+	debugfs_create_file("ring", 0444, q_debugfs_dir, NULL, &ring_fops);
+	debugfs_create_file("qtable", 0600, q_debugfs_dir, NULL, &qtable_fops);
+	if (percpu_qtable)
+		debugfs_create_file("merge_stats", 0444, q_debugfs_dir, NULL, &merge_stats_fops);
+	if (q_scope != Q_SCOPE_GLOBAL)
+		debugfs_create_file("classes", 0444, q_debugfs_dir, NULL, &classes_fops);
+	if (train_offload)
+		debugfs_create_file("train_stats", 0444, q_debugfs_dir, NULL, &train_stats_fops);
+
+	ret = register_pernet_subsys(&q_net_ops);
+	if (ret)
+		goto err_debugfs;
+
+	ret = tcp_register_congestion_control(&q_cong);
+	if (ret){
+		unregister_pernet_subsys(&q_net_ops);
+		goto err_debugfs;
+	}
+
+	if (percpu_qtable)
+		schedule_delayed_work(&merge_work, msecs_to_jiffies(max(merge_interval_msec, 1U)));
+	if (train_offload)
+		schedule_delayed_work(&train_work, msecs_to_jiffies(max(replay_interval_msec, 1U)));
+	return 0;
+
+err_debugfs:
+	debugfs_remove_recursive(q_debugfs_dir);
+	if (train_offload)
+		free_train();
+err_shards:
+	if (percpu_qtable)
+		free_shards();
+err_ring:
+	free_percpu(q_ring);
+err_class:
+	q_class_exit();
+err_matrix:
+	freeMatrix(&q_buf[0]);
+	freeMatrix(&q_buf[1]);
+	return ret;
 }
 
 static void __exit Q_cong_exit(void){
 	tcp_unregister_congestion_control(&q_cong);
+	unregister_pernet_subsys(&q_net_ops);
+	debugfs_remove_recursive(q_debugfs_dir);
+
+	// training before merge: its last updates may sit in the shards
+	if (train_offload){
+		cancel_delayed_work_sync(&train_work);
+		free_train();
+	}
+	if (percpu_qtable){
+		cancel_delayed_work_sync(&merge_work);
+		free_shards();
+	}
+	free_percpu(q_ring);
+	q_class_exit();
+	freeMatrix(&q_buf[0]);
+	freeMatrix(&q_buf[1]);
 }
 
 module_init(Q_cong_init);
@@ -0,0 +1,78 @@
+#!/bin/sh
+# tcpql_geometry.sh - write tcpql_geometry.h, which fixes the Q-table
+# geometry of tcpql.c at build time so the index of a state folds into
+# constant multiplies and shifts. The Makefiles run it for GEOMETRY=:
+#
+#   sh tcpql_geometry.sh tput_rel:10,tput_diff:19,rtt_diff:19 [up_30,up_1,down,nothing]
+#
+# Names are only checked for form here; the module resolves them at load
+# and refuses state_bins/actions parameters that disagree with the build.
+
+geometry=$1
+actions=${2:-up_30,up_1,down,nothing}
+
+if [ -z "$geometry" ]; then
+	echo "usage: $0 feature:bins,... [action,...]" >&2
+	exit 1
+fi
+
+exec awk -v geometry="$geometry" -v actions="$actions" '
+function die(msg)
+{
+	print "tcpql_geometry.sh: " msg > "/dev/stderr"
+	exit 1
+}
+
+function list(a, n, quote,	s, i)
+{
+	for (i = 1; i <= n; i++)
+		s = s (i > 1 ? ", " : "") quote a[i] quote
+	return "{ " s " }"
+}
+
+BEGIN {
+	n = split(geometry, dim, ",")
+	if (n < 1 || n > 8)
+		die(n " state dimensions, must be 1~8")
+	for (i = 1; i <= n; i++) {
+		if (split(dim[i], f, ":") != 2 || f[1] !~ /^[a-z_]+$/ ||
+		    f[2] !~ /^[0-9]+$/ || f[2] < 1 || f[2] > 255)
+			die("bad dimension \"" dim[i] "\", expected feature:bins with 1~255 bins")
+		name[i] = f[1]
+		bins[i] = f[2] + 0
+	}
+	col = split(actions, act, ",")
+	if (col < 1 || col > 8)
+		die(col " actions, must be 1~8")
+	for (i = 1; i <= col; i++)
+		if (act[i] !~ /^[a-z0-9_.]+$/)
+			die("bad action \"" act[i] "\"")
+
+	# a state is a naturally aligned power-of-two block of at most one
+	# cache line, the last dimension varies fastest
+	for (pad = 1; pad < col; pad *= 2)
+		;
+	stride[n] = pad
+	for (i = n - 1; i >= 1; i--)
+		stride[i] = stride[i + 1] * bins[i + 1]
+	size = stride[1] * bins[1]
+
+	expr = ""
+	for (i = 1; i <= n; i++)
+		expr = expr sprintf("state[%d] * %d + ", i - 1, stride[i])
+
+	printf "/* generated by tcpql_geometry.sh %s %s, do not edit */\n", geometry, actions
+	printf "#define\tQ_GEO\t\t\t\"%s %s\"\n", geometry, actions
+	printf "#define\tQ_GEO_NUM_STATE\t\t%d\n", n
+	printf "#define\tQ_GEO_FEATURES\t\t%s\n", list(name, n, "\"")
+	printf "#define\tQ_GEO_ROW\t\t%s\n", list(bins, n, "")
+	printf "#define\tQ_GEO_NUM_ACTIONS\t%d\n", col
+	printf "#define\tQ_GEO_ACTIONS\t\t%s\n", list(act, col, "\"")
+	printf "#define\tQ_GEO_COL_STRIDE\t%d\n", pad
+	printf "#define\tQ_GEO_SIZE\t\t%d\n", size
+	printf "\n"
+	printf "static inline u32 q_geo_index(const u8 *state, u8 col){\n"
+	printf "\treturn %scol;\n", expr
+	printf "}\n"
+}
+' </dev/null
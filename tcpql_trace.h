@@ -0,0 +1,75 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tcpql
+
+#if !defined(_TCPQL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TCPQL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* one Q-table update: reward for the previous action and its new value */
+TRACE_EVENT(tcpql_update,
+
+	TP_PROTO(const struct sock *sk, const u8 *state, u8 num_state, u32 action, int reward, int qvalue),
+
+	TP_ARGS(sk, state, num_state, action, reward, qvalue),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skaddr)
+		__array(u8,		state,	Q_MAX_STATE)
+		__field(u8,		num_state)
+		__field(u32,		action)
+		__field(int,		reward)
+		__field(int,		qvalue)
+	),
+
+	TP_fast_assign(
+		__entry->skaddr = sk;
+		memcpy(__entry->state, state, sizeof(__entry->state));
+		__entry->num_state = num_state;
+		__entry->action = action;
+		__entry->reward = reward;
+		__entry->qvalue = qvalue;
+	),
+
+	TP_printk("sk=%p state=%s action=%u reward=%d q=%d",
+		  __entry->skaddr, __print_array(__entry->state, __entry->num_state, sizeof(u8)),
+		  __entry->action, __entry->reward, __entry->qvalue)
+);
+
+/* one executed action and the cwnd it produced */
+TRACE_EVENT(tcpql_action,
+
+	TP_PROTO(const struct sock *sk, const u8 *state, u8 num_state, u32 action, int qvalue, u32 cwnd),
+
+	TP_ARGS(sk, state, num_state, action, qvalue, cwnd),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skaddr)
+		__array(u8,		state,	Q_MAX_STATE)
+		__field(u8,		num_state)
+		__field(u32,		action)
+		__field(int,		qvalue)
+		__field(u32,		cwnd)
+	),
+
+	TP_fast_assign(
+		__entry->skaddr = sk;
+		memcpy(__entry->state, state, sizeof(__entry->state));
+		__entry->num_state = num_state;
+		__entry->action = action;
+		__entry->qvalue = qvalue;
+		__entry->cwnd = cwnd;
+	),
+
+	TP_printk("sk=%p state=%s action=%u q=%d cwnd=%u",
+		  __entry->skaddr, __print_array(__entry->state, __entry->num_state, sizeof(u8)),
+		  __entry->action, __entry->qvalue, __entry->cwnd)
+);
+
+#endif /* _TCPQL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tcpql_trace
+#include <trace/define_trace.h>